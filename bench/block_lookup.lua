@@ -0,0 +1,99 @@
+--random block lookup latency: page-cache reads vs. mmap reads
+-- usage: lua bench/block_lookup.lua [data_path] [lookups]
+-- run it on a synced node's data dir, with the node stopped.
+local sqlite3 = require "lsqlite3"
+local gettime = require "prailude.util.lowlevel".gettime
+
+local data_path = arg[1] or "data"
+local lookups = tonumber(arg[2] or 100000)
+
+local configs = {
+  {name = "page cache", pragma = {cache_size = "-400000", mmap_size = 0}},
+  {name = "mmap",       pragma = {cache_size = "-2000",   mmap_size = ("%.0f"):format(8 * 1024^3)}},
+}
+
+local function open(pragma)
+  local db = assert(sqlite3.open(data_path .. "/nano.db", sqlite3.OPEN_READONLY))
+  for k, v in pairs(pragma) do
+    assert(db:exec(("PRAGMA %s = %s"):format(k, tostring(v))) == sqlite3.OK, db:errmsg())
+  end
+  return db
+end
+
+local function sample_hashes(n)
+  --seeking to a random key in a table keyed by random hashes is a uniform sample
+  local db = open({})
+  local stmt = assert(db:prepare("SELECT hash FROM blocks WHERE hash >= ? LIMIT 1"), db:errmsg())
+  local hashes, rand = {}, math.random
+  for _=1, n do
+    local key = {}
+    for j=1, 32 do
+      key[j] = string.char(rand(0, 255))
+    end
+    --bound the way blockdb binds hashes, or the keys won't compare equal to (or sort among) the stored ones
+    stmt:bind(1, table.concat(key))
+    local hash = stmt:urows()(stmt)
+    if hash then --nil if the key sorted past the last block
+      table.insert(hashes, hash)
+    end
+    stmt:reset()
+  end
+  stmt:finalize()
+  db:close()
+  return hashes
+end
+
+local function pass(name, stmt, hashes)
+  local latency = {}
+  local t0, t1
+  for i, hash in ipairs(hashes) do
+    t0 = gettime()
+    stmt:bind(1, hash)
+    assert(stmt:nrows()(stmt), "block went missing")
+    stmt:reset()
+    t1 = gettime()
+    latency[i] = t1 - t0
+  end
+  
+  local total = 0
+  for _, t in ipairs(latency) do
+    total = total + t
+  end
+  table.sort(latency)
+  local function pct(p)
+    return latency[math.max(1, math.floor(#latency * p))] * 1e6
+  end
+  print(("%-17s  %8i lookups  mean %7.2fus  p50 %7.2fus  p90 %7.2fus  p99 %7.2fus  total %.2fs"):format(
+    name, #latency, total / #latency * 1e6, pct(0.5), pct(0.9), pct(0.99), total))
+end
+
+local function run(config, hashes)
+  local db = open(config.pragma)
+  local stmt = assert(db:prepare("SELECT * FROM blocks WHERE hash = ?"), db:errmsg())
+  --a fresh connection starts with an empty sqlite cache, so the first pass is cold and the second warm.
+  -- the OS page cache is shared between configurations though, so the first cold pass also warms it for the rest.
+  pass(config.name .. " (cold)", stmt, hashes)
+  pass(config.name .. " (warm)", stmt, hashes)
+  stmt:finalize()
+  db:close()
+end
+
+math.randomseed(os.time())
+io.write(("sampling %i random block hashes from %s/nano.db... "):format(lookups, data_path))
+io.flush()
+local hashes = sample_hashes(lookups)
+print("done")
+if #hashes == 0 then
+  print("no blocks to look up")
+  os.exit(1)
+end
+
+--shuffle so the lookup order has nothing to do with the sampling order
+for i = #hashes, 2, -1 do
+  local j = math.random(i)
+  hashes[i], hashes[j] = hashes[j], hashes[i]
+end
+
+for _, config in ipairs(configs) do
+  run(config, hashes)
+end
@@ -1,6 +1,6 @@
 --dead simple named-event manager
-local uv = require "luv"
 local coroutine = require "prailude.util.coroutine"
+local Timer = require "prailude.util.timer"
 
 local weak_key = {__mode = 'k'}
 local mm = require "mm"
@@ -23,21 +23,15 @@ local timers = setmetatable({}, {__mode="k"})
 local function cancel_timer(cb)
   local timer = rawget(timers, cb)
   if timer then
-    timer:stop()
-    timer:close()
+    Timer.cancel(timer)
     rawset(timers, cb, nil)
   end
   return timer
 end
 local function set_timer(channel, cb, is_coroutine, timeout)
-  local timer = rawget(timers, cb)
-  if timer then
-    timer:stop()
-  else
-    timer = uv.new_timer()
-    rawset(timers, cb, timer)
-  end
-  timer:start(timeout, 0, function()
+  cancel_timer(cb)
+  local timer = Timer.delay(timeout, function()
+    rawset(timers, cb, nil)
     log:debug("bus: channel %s timed out", channel)
     if is_coroutine then
       channels[channel].coroutines[cb] = nil
@@ -46,10 +40,8 @@ local function set_timer(channel, cb, is_coroutine, timeout)
       channels[channel].callbacks[cb] = nil
       cb(false)
     end
-    timer:stop()
-    timer:close()
-    rawset(timers, cb, nil)
   end)
+  rawset(timers, cb, timer)
   return timer
 end
 
@@ -8,12 +8,18 @@ local cfg = {
   },
   bootstrap = {
     min_frontier_size = 430000,
-    max_peers = 50,
-    
+    max_peers = 50, --most peers pulled from at once. bulk pull concurrency adapts to the link below that
+    bulk_pull_window = 8, --bulk_pull requests kept outstanding on each peer's connection
+    snapshot = nil, --path to a trusted ledger snapshot to start from, instead of verifying everything from genesis
+    export_snapshot = nil, --path to write a ledger snapshot to once bootstrap's done, for other nodes to start from
   },
   data = {
     db = "sqlite-tc",
-    path = "data"
+    path = "data",
+    sort_threads = 0, --helper threads for sorting and index builds. 0 means one per cpu core
+    wal = true, --write-ahead log, so reader connections don't block on (or block) writes
+    checkpoint_interval = 5000, --ms between background WAL checkpoints
+    mmap_size = 8 * 1024^3, --bytes of the db file to read through mmap instead of the page cache. 0 to disable
   }
 }
 
@@ -46,6 +46,15 @@ function Control.be_nice_to_event_loop(func)
 end
 ]]
 
+--write the validated ledger out as a snapshot another node can start from. nblocks, naccounts or nil, err
+function Control.write_snapshot(path)
+  if not initialized then
+    Control.initialize()
+  end
+  local Snapshot = require "prailude.snapshot"
+  return Snapshot.write(path)
+end
+
 function Control.run(runfunc)
   if not initialized then
     Control.initialize()
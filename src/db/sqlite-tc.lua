@@ -1,6 +1,9 @@
 local sqlite3 = require "lsqlite3"
+local uv = require "luv"
 local Bus = require "prailude.bus"
 local config = require "prailude.config"
+local Timer = require "prailude.util.timer"
+local log = require "prailude.log"
 
 local subdbs = {
   require "prailude.db.sqlite-tc.peer",
@@ -9,10 +12,13 @@ local subdbs = {
   require "prailude.db.sqlite-tc.frontier",
   require "prailude.db.sqlite-tc.account",
   require "prailude.db.sqlite-tc.kv",
+  require "prailude.db.sqlite-tc.snapshot",
 }
 
 local default_db
 local dbs = {}
+local db_paths = {}
+local checkpointer
 local DB = {}
 
 function DB.pragma(db, pragma_list)
@@ -30,12 +36,22 @@ end
 
 function DB.open(name, opt)
   assert(not dbs[name], "db with name " .. name .. " already exists")
-  local db, err_code, err_msg = sqlite3.open(config.data.path.."/"..(opt.db_file or name..".db"))
+  local path = config.data.path.."/"..(opt.db_file or name..".db")
+  local db, err_code, err_msg = sqlite3.open(path)
   if not db then
     error("error opening db  " .. name .. ": " .. (err_msg or err_code))
   end
   DB.pragma(db, opt.pragma)
+  if opt.wal then
+    -- must come after page_size and friends: the page size can't change once in WAL mode
+    DB.pragma(db, {
+      journal_mode = "WAL",
+      locking_mode = "NORMAL", --EXCLUSIVE would keep other connections from reading
+      wal_autocheckpoint = 0, --checkpoints are done in the background by DB.checkpoint
+    })
+  end
   dbs[name]=db
+  db_paths[name]=path
   return db
 end
 
@@ -52,10 +68,16 @@ function DB.transaction(db, fn)
     db, fn = default_db, db
   end
   
-  assert(db:exec("BEGIN EXCLUSIVE TRANSACTION") == sqlite3.OK, db:errmsg())
+  --in WAL mode this only locks out other writers. readers keep reading their snapshots
+  assert(db:exec("BEGIN IMMEDIATE TRANSACTION") == sqlite3.OK, db:errmsg())
   fn()
   local ok = db:exec("COMMIT TRANSACTION") == sqlite3.OK
   if ok then
+    for _, subdb in ipairs(subdbs) do
+      if subdb.committed then
+        subdb.committed()
+      end
+    end
     return db:total_changes()
   else
     return nil, db:errmsg()
@@ -72,18 +94,92 @@ function DB.first_result(query)
   return f(t)
 end
 
+--open a separate read-only connection to a database, for consistent reads that don't block
+-- (and aren't blocked by) the main connection's writes. only useful in WAL mode.
+-- lsqlite3 connections can't be shared between lua states, so a worker thread should open its own.
+function DB.open_reader(name)
+  local path = assert(db_paths[name or "nano"], "no such db")
+  local reader, err_code, err_msg = sqlite3.open(path, sqlite3.OPEN_READONLY)
+  if not reader then
+    return nil, err_msg or err_code
+  end
+  reader:busy_timeout(1000)
+  return reader
+end
+
+--run fn(reader) inside a read transaction. everything it reads comes from the same snapshot
+-- of the db, no matter what gets committed on the main connection in the meantime
+function DB.read_snapshot(reader, fn)
+  assert(reader:exec("BEGIN DEFERRED TRANSACTION") == sqlite3.OK, reader:errmsg())
+  local ok, res, err = pcall(fn, reader)
+  reader:exec("COMMIT TRANSACTION")
+  if not ok then
+    error(res, 0)
+  end
+  return res, err
+end
+
+do
+  --runs in a libuv threadpool thread with its own lua state, so no upvalues allowed
+  local function checkpoint_work(path, mode)
+    local sqlite3_thread = require "lsqlite3"
+    local db, err_code, err_msg = sqlite3_thread.open(path)
+    if not db then
+      return nil, err_msg or tostring(err_code)
+    end
+    db:busy_timeout(1000)
+    local vm = db:prepare(("PRAGMA wal_checkpoint(%s)"):format(mode))
+    if not vm then
+      local err = db:errmsg()
+      db:close()
+      return nil, err
+    end
+    local busy, wal_pages, checkpointed_pages = vm:urows()(vm)
+    vm:finalize()
+    db:close()
+    return busy == 0, wal_pages, checkpointed_pages
+  end
+  
+  local running = false
+  local work = uv.new_work(checkpoint_work, function(ok, wal_pages_or_err, checkpointed_pages)
+    running = false
+    if ok == nil then
+      log:warn("db: WAL checkpoint failed: %s", tostring(wal_pages_or_err))
+    elseif wal_pages_or_err and checkpointed_pages and checkpointed_pages < wal_pages_or_err then
+      log:debug("db: WAL checkpoint partial: %i of %i pages", checkpointed_pages, wal_pages_or_err)
+    end
+  end)
+  
+  --checkpoint the WAL into the main db file from a background thread.
+  -- PASSIVE never waits on readers or writers, it just copies what it can.
+  function DB.checkpoint(name, mode)
+    if running then
+      return false
+    end
+    running = true
+    return uv.queue_work(work, assert(db_paths[name or "nano"], "no such db"), mode or "PASSIVE")
+  end
+end
+
 function DB.initialize()
   --opt = opt or {}
+  local sort_threads = config.data.sort_threads
+  if not sort_threads or sort_threads == 0 then
+    sort_threads = #uv.cpu_info()
+  end
   local db = DB.open("nano", {
     pragma = {
       synchronous = false, --don't really care if the db lags behind on crash
-      journal_mode = "TRUNCATE",
+      journal_mode = not config.data.wal and "TRUNCATE" or nil,
       temp_store = "FILE",
       foreign_keys = "OFF",
-      locking_mode = "EXCLUSIVE",
+      locking_mode = not config.data.wal and "EXCLUSIVE" or nil,
       cache_size = "-400000", --200MB max cachesize
+      mmap_size = ("%.0f"):format(config.data.mmap_size or 0), --clamped to SQLITE_MAX_MMAP_SIZE by sqlite
       page_size = 16384,
-    }
+      threads = sort_threads, --parallel external merge-sort for big ORDER BYs and CREATE INDEX
+    },
+    wal = config.data.wal
   })
   default_db = db
   assert(db:exec("ATTACH DATABASE ':memory:' as mem") == sqlite3.OK, db:errmsg())
@@ -98,6 +194,11 @@ function DB.initialize()
   for _, subdb in ipairs(subdbs) do
     subdb.initialize(db)
   end
+  if config.data.wal then
+    checkpointer = Timer.interval(config.data.checkpoint_interval or 5000, function()
+      DB.checkpoint("nano")
+    end)
+  end
   Bus.sub("shutdown", DB.shutdown)
 end
   
@@ -107,7 +208,25 @@ function DB.shutdown()
       subdb.shutdown()
     end
   end
-  for _, db in ipairs(dbs) do
+  if checkpointer then
+    Timer.cancel(checkpointer)
+    checkpointer = nil
+    --fold the whole WAL back in and truncate it. a background checkpoint might still be running
+    -- on its own connection, so wait for its locks instead of failing outright
+    default_db:busy_timeout(5000)
+    local vm = default_db:prepare("PRAGMA wal_checkpoint(TRUNCATE)")
+    local busy, wal_pages, checkpointed_pages
+    if vm then
+      busy, wal_pages, checkpointed_pages = vm:urows()(vm)
+      vm:finalize()
+    end
+    if busy == nil then
+      log:warn("db: shutdown WAL checkpoint failed: %s", default_db:errmsg())
+    elseif busy ~= 0 then
+      log:warn("db: shutdown WAL checkpoint incomplete: %i of %i pages", checkpointed_pages or 0, wal_pages or 0)
+    end
+  end
+  for _, db in pairs(dbs) do
     db:close()
   end
 end
@@ -1,6 +1,10 @@
 local Account
 local sqlite3 = require "lsqlite3"
 local Util = require "prailude.util"
+local Balance = require "prailude.util.balance"
+local LedgerState = require "prailude.util.ledgerstate"
+local config = require "prailude.config"
+local log = require "prailude.log"
 
 local function schema(tbl_type, tbl_name)
   local _, tbl = tbl_name:match("^(.+%.)(.+)")
@@ -14,6 +18,7 @@ local function schema(tbl_type, tbl_name)
     delegated_balance     REAL, --inexactness is ok here
     
     behind                INTEGER NOT NULL DEFAULT 0,
+    block_count           INTEGER NOT NULL DEFAULT 0, --confirmation height: this many blocks are ledger-valid, up to and including frontier
     --valid                 INTEGER NOT NULL DEFAULT 0,
     
     --genesis_distance      INTEGER, -- number of accounts to reach genesis account
@@ -32,11 +37,134 @@ end
 
 local sql = {}
 
+--the whole (non-bootstrap) account table, in memory. all non-bootstrap account reads come
+-- from here, and writes go here first. it's kept on disk as a snapshot plus a log of changes since.
+-- the accounts table catches up in batches: changed accounts are spilled to it once enough of them
+-- pile up, and whenever something's about to read it. until then the ledger log has them
+local ledger
+local ledger_snapshot_path, ledger_log_path
+local dirty, dirty_count = {}, 0 --account id -> true, for accounts the accounts table is behind on
+local spill_batch = 10000 --dirty accounts
+local snapshot_after = 500000 --ledger log entries. past this, the log is folded into a new snapshot
+local source_peers = {} --account id -> source_peer. not in the ledger state, and there aren't many
+
 local cache = Util.Cache("weak")
 local cache_bootstrap = Util.Cache("weak")
 
-local account_update, bootstrap_account_update = {}, {}
+--what save_later() and update() take
+local updatable = {frontier = true, representative = true, delegated_balance = true, behind = true, source_peer = true, block_count = true, balance = true}
 local db
+
+local function account_from_row(row)
+  if row.behind == 0 or row.behind == "0" then
+    row.behind = false
+  elseif row.behind == 1 or row.behind == "1" then
+    row.behind = true
+  else
+    error("invalid account.behind value " .. tostring(row.behind))
+  end
+  return Account.new(row)
+end
+
+local function account_from_ledger(state)
+  if state.balance then
+    state.balance = Balance.unpack(state.balance)
+  end
+  state.source_peer = source_peers[state.id]
+  return Account.new(state)
+end
+
+local function bind_account(stmt, acct)
+  stmt:bind(1, acct.id)
+  stmt:bind(2, acct.frontier)
+  stmt:bind(3, acct.representative)
+  stmt:bind(4, acct.delegated_balance)
+  stmt:bind(5, acct.behind and 1 or 0)
+  if acct.source_peer then
+    stmt:bind(6, tostring(acct.source_peer))
+  else
+    stmt:bind(6, nil)
+  end
+  stmt:bind(7, acct.block_count or 0)
+end
+
+local function ledger_set(acct)
+  ledger:set(acct)
+  if acct.source_peer then
+    source_peers[acct.id] = tostring(acct.source_peer)
+  end
+  if not dirty[acct.id] then
+    dirty[acct.id] = true
+    dirty_count = dirty_count + 1
+  end
+end
+
+--write the accounts the accounts table is behind on, as the ledger has them now
+local function spill()
+  if dirty_count == 0 then
+    return
+  end
+  local now_dirty = dirty
+  dirty, dirty_count = {}, 0
+  local set, delete = sql.account_set, sql.account_delete
+  assert(db:exec("BEGIN IMMEDIATE TRANSACTION") == sqlite3.OK, db:errmsg())
+  for id in pairs(now_dirty) do
+    local state = ledger:get(id)
+    if state then
+      state.source_peer = source_peers[id]
+      bind_account(set, state)
+      set:step()
+      set:reset()
+    else --created in a transaction that was rolled back
+      delete:bind(1, id)
+      delete:step()
+      delete:reset()
+    end
+  end
+  assert(db:exec("COMMIT TRANSACTION") == sqlite3.OK, db:errmsg())
+end
+
+--fold the log into a fresh snapshot. whatever's in the log has to be in the accounts table first,
+-- since after a crash the log's entries are what gets spilled again
+local function ledger_write_snapshot()
+  spill()
+  local ok, err = ledger:write_snapshot(ledger_snapshot_path)
+  if not ok then
+    log:warn("accountdb: %s", err)
+  end
+  return ok, err
+end
+
+local function ledger_load()
+  for row in db:nrows("SELECT id, source_peer FROM accounts WHERE source_peer IS NOT NULL") do
+    source_peers[row.id] = row.source_peer
+  end
+  local n, err = ledger:read_snapshot(ledger_snapshot_path)
+  if n then
+    --the accounts table may not have caught up with the log before the last shutdown
+    local replayed = {}
+    n = n + ledger:open_log(ledger_log_path, replayed)
+    for _, id in ipairs(replayed) do
+      if not dirty[id] then
+        dirty[id] = true
+        dirty_count = dirty_count + 1
+      end
+    end
+    spill()
+    log:debug("accountdb: loaded %i ledger state entries", n)
+    return
+  end
+  --no usable snapshot. the accounts table is the authority then, and any old log is meaningless without its snapshot
+  log:debug("accountdb: %s, rebuilding ledger state from accounts table", err)
+  os.remove(ledger_log_path)
+  for row in db:nrows("SELECT id, frontier, representative, delegated_balance, behind, block_count FROM accounts") do
+    row.behind = row.behind == 1 or row.behind == "1"
+    ledger:set(row)
+  end
+  assert(ledger:write_snapshot(ledger_snapshot_path))
+  ledger:open_log(ledger_log_path)
+end
+
 local AccountDB_meta = {__index = {
   find = function(id, opt)
     assert(type(id)=="string")
@@ -46,65 +174,55 @@ local AccountDB_meta = {__index = {
       return acct
     elseif acct == false then
       return nil
+    elseif opt ~= "bootstrap" then
+      acct = ledger:get(id)
+      acct = acct and account_from_ledger(acct)
+      mycache:set(id, acct or false)
+      return acct
     else
       local stmt = opt == "bootstrap" and sql.boostrap_account_get or sql.account_get
       stmt:bind(1, id)
       acct = stmt:nrows()(stmt)
       stmt:reset()
       if acct then
-        if acct.behind == 0 or acct.behind == "0" then
-          acct.behind = false
-        elseif acct.behind == 1 or acct.behind == "1" then
-          acct.behind = false
-        else
-          error("invalid account.behind value " .. tostring(acct.behind))
-        end
-        acct = Account.new(acct)
+        acct = account_from_row(acct)
       end
       mycache:set(id, acct or false)
       return acct
     end
   end,
   
-  store = function(self, opt)
-    local stmt, mycache
-    if opt == "bootstrap" then
-      stmt, mycache = sql.bootstrap_account_update, cache_bootstrap
-    else
-      stmt, mycache = sql.account_set, cache
+  find_many = function(ids)
+    --no round-trips to batch up anymore with the ledger state in memory, but callers still like the map
+    local found = {}
+    for _, id in ipairs(ids) do
+      found[id] = Account.find(id) or nil
     end
+    return found
+  end,
   
-    stmt:bind(1, self.id)
-    stmt:bind(2, self.frontier)
-    stmt:bind(3, self.representative)
-    stmt:bind(4, self.delegated_balance)
-    
+  store = function(self, opt)
     if self.behind == 0 or self.behind == "0" then
       self.behind = false
     end
-    stmt:bind(5, self.behind and 1 or 0)
     
-    if self.source_peer then
-      stmt:bind(6, tostring(self.source_peer))
+    if opt == "bootstrap" then
+      local stmt = sql.bootstrap_account_update
+      bind_account(stmt, self)
+      stmt:step()
+      --TODO: check for sqlite3.BUSY and such responses
+      stmt:reset()
+      cache_bootstrap:set(self.id, self)
     else
-      stmt:bind(6, nil)
+      ledger_set(self)
+      cache:set(self.id, self)
     end
-    
-    stmt:step()
-    --TODO: check for sqlite3.BUSY and such responses
-    stmt:reset()
-    
-    --cache update
-    mycache:set(self.id, self)
     return self
   end,
   
   update = function(self, what, no_cache_update)
-    local stmt = assert(account_update[what], "not a valid account field")
-    stmt:bind(1, self[what])
-    stmt:bind(2, self.id)
-    stmt:step()
-    stmt:reset()
+    assert(updatable[what], "not a valid account field")
+    ledger_set(self)
     if not no_cache_update then
       cache:set(self.id, self)
     end
@@ -132,49 +250,109 @@ local AccountDB_meta = {__index = {
     if slist.CREATE then
       return self:store()
     end
-    cache:set(self.id, self)
-    for what, _ in pairs(slist) do --not the most efficient, but whatever
-      self:update(what, nil, true)
+    for what in pairs(slist) do
+      assert(updatable[what], "not a valid account field")
     end
+    cache:set(self.id, self)
+    ledger_set(self) --once for all the fields
     return self
   end,
   
   get_frontier = function(account_id)
-    local stmt = sql.account_get_frontier
-    stmt:bind(1, account_id)
-    local frontier = stmt:urows()(stmt)
-    stmt:reset()
-    return frontier
+    return ledger:frontier(account_id)
+  end,
+  
+  --accounts with blocks still to walk. this is where an interrupted walk picks back up
+  find_behind = function()
+    spill()
+    local accts = {}
+    for id in db:urows("SELECT id FROM accounts WHERE behind = 1") do
+      table.insert(accts, (Account.find(id)))
+    end
+    return accts
+  end,
+  
+  count_confirmed_blocks = function()
+    spill()
+    local rows, vm = db:urows("SELECT SUM(block_count) FROM accounts")
+    return rows(vm) or 0
+  end,
+  
+  clear = function()
+    --without a snapshot, a crash anywhere in here has the ledger rebuilt from the accounts table.
+    -- an old snapshot would bring the cleared accounts back
+    os.remove(ledger_snapshot_path)
+    dirty, dirty_count = {}, 0
+    source_peers = {}
+    assert(db:exec("DELETE FROM accounts") == sqlite3.OK, db:errmsg())
+    ledger:clear()
+    assert(ledger:write_snapshot(ledger_snapshot_path))
+    cache:clear()
+  end,
+  
+  --bring the accounts table up to date with the ledger, for anything about to read it directly
+  spill = function()
+    spill()
   end
 }}
 
-return {
+local AccountDB
+AccountDB = {
   initialize = function(db_ref)
     Account = require "prailude.account"
     db = db_ref
     assert(db:exec(schema("TABLE", "accounts")) == sqlite3.OK, db:errmsg())
+    do --accounts tables from before there was a confirmation height
+      local has_block_count = false
+      for col in db:nrows("PRAGMA table_info(accounts)") do
+        if col.name == "block_count" then has_block_count = true end
+      end
+      if not has_block_count then
+        assert(db:exec("ALTER TABLE accounts ADD COLUMN block_count INTEGER NOT NULL DEFAULT 0") == sqlite3.OK, db:errmsg())
+      end
+    end
     
     sql.account_get = assert(db:prepare("SELECT * FROM accounts WHERE id = ?"), db:errmsg())
     
-    sql.account_get_frontier = assert(db:prepare("SELECT frontier FROM accounts WHERE id = ?"), db:errmsg())
-    
     sql.account_set = assert(db:prepare("INSERT OR REPLACE INTO accounts " ..
-      "      (id, frontier, representative, delegated_balance, behind, source_peer) " ..
-      "VALUES(?,         ?,              ?,                 ?,      ?,           ?)"), db:errmsg())
+      "      (id, frontier, representative, delegated_balance, behind, source_peer, block_count) " ..
+      "VALUES(?,         ?,              ?,                 ?,      ?,           ?,           ?)"), db:errmsg())
     
-    for _, n in ipairs {"frontier", "representative", "delegated_balance", "behind", "source_peer"} do
-      account_update[n]=assert(db:prepare("UPDATE accounts SET " .. n .. " = ? WHERE id = ?"), n .. ":  " .. db:errmsg())
-    end
+    sql.account_delete = assert(db:prepare("DELETE FROM accounts WHERE id = ?"), db:errmsg())
+    
+    ledger = LedgerState.new()
+    ledger_snapshot_path = config.data.path.."/ledger.snapshot"
+    ledger_log_path = config.data.path.."/ledger.log"
+    ledger_load()
+    --ledger log entries only count once the transaction that wrote them commits, autocommits included
+    db:commit_hook(function()
+      ledger:commit()
+      return false
+    end)
+    db:rollback_hook(function()
+      ledger:rollback()
+    end)
     
     setmetatable(Account, AccountDB_meta)
   end,
   
+  committed = function()
+    ledger:flush()
+    if ledger:log_count() >= snapshot_after then
+      --so the log doesn't grow for the whole bootstrap, and a crash doesn't mean replaying all of it
+      ledger_write_snapshot()
+    elseif dirty_count >= spill_batch then
+      spill()
+    end
+  end,
+  
   shutdown = function()
-    for _, sql_stmts in ipairs{sql, account_update, bootstrap_account_update} do
-      for _, v in pairs(sql_stmts) do
-        v:finalize()
-      end
+    --fold the log into a fresh snapshot so the next startup has nothing to replay
+    ledger_write_snapshot()
+    for _, v in pairs(sql) do
+      v:finalize()
     end
+    ledger:close_log()
   end,
   
   batch_store = function(batch, opt)
@@ -183,5 +361,8 @@ return {
       account:store(opt)
     end
     assert(db:exec("COMMIT TRANSACTION") == sqlite3.OK, db:errmsg())
+    AccountDB.committed()
   end
 }
+
+return AccountDB
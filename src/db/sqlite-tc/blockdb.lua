@@ -2,16 +2,18 @@ local Block
 local sqlite3 = require "lsqlite3"
 local mm = require "mm"
 local Util = require "prailude.util"
+local Multiget = require "prailude.db.sqlite-tc.multiget"
+local Bloom = require "prailude.util.bloom"
+local config = require "prailude.config"
+local log = require "prailude.log"
 
 local function indices(what, tbl_name)
   local _, tbl = tbl_name:match("^(.+%.)(.+)")
   local idxes = {
     _account_idx = "account",
     _account_and_type_idx = "account, type",
-    _prev_idx = "previous",
     _valid_idx = "valid",
     _type_idx = "type",
-    _source_idx = "source",
     _rep_idx = "representative",
     _dst_idx = "destination"
   }
@@ -62,11 +64,51 @@ local schema = function(tbl_type, tbl_name, skip_indices)
   return schema
 end
 
+--forward links, written alongside the blocks: hash -> the block whose previous (kind 0) or source (kind 1) it is.
+-- following a chain forward is one primary-key lookup per hop
+local successors_schema = [[
+  CREATE TABLE IF NOT EXISTS block_successors (
+    hash                 BLOB,
+    kind                 INTEGER, --0: next block in the account chain
+                                  --1: receive or open of a send
+    next                 BLOB,
+    PRIMARY KEY(hash, kind)
+  ) WITHOUT ROWID;
+]]
+local successor_kind = {previous = 0, source = 1}
+
 local sql={}
+local block_get_many, successor_get_many
+local import_successors_range = {} --one INSERT ... SELECT per successor kind
+
+local db
+
+local function rebuild_indices(tbl_name)
+  -- each CREATE INDEX is a full external merge-sort of the table. with PRAGMA threads set
+  -- (see DB.initialize), sqlite sorts the runs in parallel worker threads, so this scales
+  -- with cores. one transaction for the lot keeps the table pages hot between builds.
+  assert(db:exec("BEGIN EXCLUSIVE TRANSACTION") == sqlite3.OK, db:errmsg())
+  assert(db:exec(indices("create", tbl_name)) == sqlite3.OK, db:errmsg())
+  assert(db:exec("COMMIT TRANSACTION") == sqlite3.OK, db:errmsg())
+end
 
 local cache = Util.Cache("weak")
 
-local db
+--every hash in the blocks table. a hash it's never seen is a block we don't have, no db read needed
+local bloom, bloom_path
+local function bloom_rebuild(capacity)
+  bloom = Bloom.new(capacity, 0.01)
+  for hash in db:urows("SELECT hash FROM blocks") do
+    bloom:add(hash)
+  end
+end
+local function bloom_add(hash)
+  if bloom:add(hash) and bloom:count() > bloom:capacity() then
+    --past what it was sized for, the false-positive rate climbs fast. start over, bigger
+    bloom_rebuild(bloom:count() * 2)
+  end
+end
+
 local function valid_code(valid)
   if not valid then
     return 0
@@ -87,6 +129,9 @@ local BlockDB_meta = {__index = {
   find = function(hash)
     local block, stmt = cache:get(hash), sql.block_get
     if block == nil then
+      if not hash or not bloom:test(hash) then
+        return nil
+      end
       --print("CACHE: block "  .. Util.bytes_to_hex(hash) .. " not in cache")
       stmt:bind(1, hash)
       block = stmt:nrows()(stmt)
@@ -106,17 +151,32 @@ local BlockDB_meta = {__index = {
     end
   end,
   
-  find_by_account = function(acct)
-    local blocks = {}
-    local stmt = sql.block_get_by_acct
-    stmt:bind(1, acct)
+  --a map of hash -> block for the blocks that were found. the rest are left nil
+  find_many = function(hashes)
+    local found, missing, seen = {}, {}, {}
     local block
-    for _, block_data in stmt:nrows() do
-      block = cache:get(block_data.hash) or Block.new(block_data)
-      table.insert(blocks, block)
+    for _, hash in ipairs(hashes) do
+      block = cache:get(hash)
+      if block then
+        found[hash] = block
+      elseif block == nil and not seen[hash] then
+        seen[hash] = true --so duplicates are only looked up once
+        if bloom:test(hash) then
+          table.insert(missing, hash)
+        end
+      end
     end
-    stmt:reset()
-    return blocks
+    Multiget.run(block_get_many, missing, function(row)
+      block = Block.new(row)
+      cache:set(block.hash, block)
+      found[block.hash] = block
+    end)
+    for _, hash in ipairs(missing) do
+      if not found[hash] then
+        cache:set(hash, false)
+      end
+    end
+    return found
   end,
   
   store = function(self, opt)
@@ -148,6 +208,10 @@ local BlockDB_meta = {__index = {
     stmt:step()
     --TODO: check for sqlite3.BUSY and such responses
     stmt:reset()
+    if opt ~= "bootstrap" then
+      Block.store_successors(self)
+      bloom_add(self.hash)
+    end
     if opt ~= "bootstrap" and not self.__already_cached then
       cache:set(self.hash, self)
       self.__already_cached = true
@@ -155,6 +219,25 @@ local BlockDB_meta = {__index = {
     return self
   end,
   
+  store_successors = function(self)
+    local stmt = sql.successor_set
+    for what, kind in pairs(successor_kind) do
+      local parent = self[what]
+      if parent then
+        stmt:bind(1, parent)
+        stmt:bind(2, kind)
+        stmt:bind(3, self.hash)
+        stmt:step()
+        stmt:reset()
+      end
+    end
+  end,
+  
+  --for blocks written to the blocks table without going through Block.store
+  mark_stored = function(hash)
+    bloom_add(hash)
+  end,
+  
   store_later = function(self)
     cache:set(self.hash, self)
     self.__already_cached = true
@@ -174,67 +257,112 @@ local BlockDB_meta = {__index = {
     local stmt = sql.block_update_ledger_validation
     stmt:bind(1, valid_code(self.valid))
     stmt:bind(2, self.genesis_distance)
-    stmt:bind(3, self.hash)
+    local balance = self.balance
+    stmt:bind(3, type(balance)=="userdata" and balance:pack() or balance)
+    stmt:bind(4, self.hash)
     stmt:step()
     stmt:reset()
     return self
   end,
   
+  --forget all ledger validation, down to signature-checked
+  clear_ledger_validation = function()
+    assert(db:exec("UPDATE blocks SET valid = 2 WHERE valid > 2") == sqlite3.OK, db:errmsg())
+  end,
+  
   clear_bootstrap = function()
     assert(db:exec("DELETE FROM disktmp.blocks") == sqlite3.OK, db:errmsg())
   end,
   
-  import_unverified_bootstrap_blocks = function(interrupt_callback, progress_callback)
+  --opt.from: first staging rowid to import, for picking up where the last call left off
+  --opt.reindex: false to never drop the indices, for when something's reading the blocks table mid-import
+  --opt.touched(account_ids): called with each range's accounts once they're imported
+  --returns true, and the rowid the next import should start from
+  import_unverified_bootstrap_blocks = function(interrupt_callback, progress_callback, opt)
     local gettime = require "prailude.util.lowlevel".gettime
-    local block_count, import_block_count = Block.count(), Block.count_bootstrapped()
-    
-    local reindex = block_count + import_block_count > block_count * 1.20
-      -- anything above a 20% differentce should trigger a reindex
+    opt = opt or {}
+    local reindex = opt.reindex
+    if reindex == nil then
+      local block_count, import_block_count = Block.count(), Block.count_bootstrapped()
+      reindex = block_count + import_block_count > block_count * 1.20
+        -- anything above a 20% differentce should trigger a reindex
+    end
     if reindex then
       print("drop block index during import")
       assert(db:exec(indices("drop", "blocks")) == sqlite3.OK, db:errmsg())
     end
-    local batch_size = 5000
+    local batch_size = 50000
     local t0 = gettime()
     
-    local Block_store = Block.store
-    local function commit_batch(batch)
-      assert(db:exec("BEGIN TRANSACTION") == sqlite3.OK, db:errmsg())
-      for _, block in ipairs(batch) do
-        Block_store(block)
-      end
-      assert(db:exec("COMMIT TRANSACTION") == sqlite3.OK, db:errmsg())
-    end
-    
-    local batch = {}
-    local tinsert = table.insert
-    for row in db:nrows("SELECT * FROM disktmp.blocks;") do
+    --staged blocks are moved over in rowid ranges, one INSERT ... SELECT per range. each range
+    -- is sorted by hash on the way in so it lands in the blocks b-tree as an ordered run.
+    -- no row ever gets turned into a lua table.
+    local stmt = sql.import_bootstrap_range
+    local rows, vm = db:urows("SELECT MIN(rowid), MAX(rowid) FROM disktmp.blocks")
+    local first, last = rows(vm)
+    first, last = math.max(first or 1, opt.from or 1), last or 0
+    for range_start = first, last, batch_size do
+      --rows staged after the MAX() above are left for the next call
+      local range_end = math.min(range_start + batch_size, last + 1)
       if interrupt_callback then
         interrupt_callback()
       end
-      tinsert(batch, row)
-      if #batch >= batch_size then
-        local n = #batch
-        commit_batch(batch)
-        local t1 = gettime()
-        progress_callback(n, t1 - t0, t1)
-        t0 = gettime()
-        batch = {}
+      stmt:bind(1, range_start)
+      stmt:bind(2, range_end)
+      assert(db:exec("BEGIN TRANSACTION") == sqlite3.OK, db:errmsg())
+      if stmt:step() ~= sqlite3.DONE then
+        local err = db:errmsg()
+        stmt:reset()
+        db:exec("ROLLBACK TRANSACTION")
+        error("bootstrap block import failed: " .. err)
+      end
+      local n = db:changes()
+      stmt:reset()
+      for _, succ_stmt in ipairs(import_successors_range) do
+        succ_stmt:bind(1, range_start)
+        succ_stmt:bind(2, range_end)
+        assert(succ_stmt:step() == sqlite3.DONE, db:errmsg())
+        succ_stmt:reset()
       end
+      local hashes = sql.bootstrap_range_hashes
+      hashes:bind(1, range_start)
+      hashes:bind(2, range_end)
+      for hash in hashes:urows() do
+        bloom_add(hash)
+        if cache:get(hash) == false then --looked up before it got here
+          cache:set(hash, nil)
+        end
+      end
+      hashes:reset()
+      assert(db:exec("COMMIT TRANSACTION") == sqlite3.OK, db:errmsg())
+      if opt.touched then
+        local accts, acct_stmt = {}, sql.bootstrap_range_accounts
+        acct_stmt:bind(1, range_start)
+        acct_stmt:bind(2, range_end)
+        for acct_id in acct_stmt:urows() do
+          table.insert(accts, acct_id)
+        end
+        acct_stmt:reset()
+        opt.touched(accts)
+      end
+      local t1 = gettime()
+      progress_callback(n, t1 - t0, t1)
+      t0 = t1
     end
     
     if reindex then
       print("recreate block index after import")
-      assert(db:exec(indices("create", "blocks")) == sqlite3.OK, db:errmsg())
+      t0 = gettime()
+      rebuild_indices("blocks")
+      print(("recreated block index in %.2fs"):format(gettime() - t0))
     end
-    return true
+    return true, math.max(first, last + 1)
   end,
   
   get_child_hashes = function(block)
     local hashes = {}
     local stmt = sql.get_child_hashes
     stmt:bind(1, block.hash)
-    stmt:bind(2, block.hash)
     for hash in stmt:urows() do
       table.insert(hashes, hash)
     end
@@ -265,15 +393,13 @@ local BlockDB_meta = {__index = {
   end,
   
   find_block_by = function(what, val)
-    local stmt
-    if what == "source" then
-      stmt = sql.block_get_by_source
-    elseif what == "previous" then
-      stmt = sql.block_get_by_previous
-    else
+    local kind = successor_kind[what]
+    if not kind then
       error("can't find block by " .. tostring(what))
     end
+    local stmt = sql.block_get_successor
     stmt:bind(1, val)
+    stmt:bind(2, kind)
     local block = stmt:nrows()(stmt)
     stmt:reset()
     if block then
@@ -282,6 +408,21 @@ local BlockDB_meta = {__index = {
     return block
   end,
   
+  --the next block in the account chain after each of these hashes, {[hash] = next_block}
+  find_next_many = function(hashes)
+    local found = {}
+    local keys = {}
+    for i, hash in ipairs(hashes) do
+      keys[i] = hash
+    end
+    Multiget.run(successor_get_many, keys, function(row)
+      local parent = row.successor_of
+      row.successor_of = nil
+      found[parent] = cache:get(row.hash) or Block.new(row)
+    end)
+    return found
+  end,
+  
   find_open_for_account = function(acct_id)
     local stmt = sql.find_open_by_account
     stmt:bind(1, acct_id)
@@ -301,11 +442,27 @@ return {
     db = db_ref
     assert(db:exec(schema("TABLE", "blocks")) == sqlite3.OK, db:errmsg())
     assert(db:exec(schema("TABLE", "disktmp.blocks", true)) == sqlite3.OK, db:errmsg())
+    assert(db:exec(successors_schema) == sqlite3.OK, db:errmsg())
+    --the ledger-valid blocks used to be copied out into per-account chain segments. the blocks table has it all
+    assert(db:exec("DROP TABLE IF EXISTS account_chains") == sqlite3.OK, db:errmsg())
+    do --blocks stored before there were successor links
+      local rows, vm = db:urows("SELECT (SELECT COUNT(*) FROM (SELECT 1 FROM blocks LIMIT 1)), (SELECT COUNT(*) FROM (SELECT 1 FROM block_successors LIMIT 1))")
+      local have_blocks, have_successors = rows(vm)
+      if have_blocks > 0 and have_successors == 0 then
+        assert(db:exec("INSERT OR IGNORE INTO block_successors SELECT previous, 0, hash FROM blocks WHERE previous IS NOT NULL;" ..
+                       "INSERT OR IGNORE INTO block_successors SELECT source, 1, hash FROM blocks WHERE source IS NOT NULL;") == sqlite3.OK, db:errmsg())
+      end
+      --the successor links replace these
+      assert(db:exec("DROP INDEX IF EXISTS blocks_prev_idx; DROP INDEX IF EXISTS blocks_source_idx;") == sqlite3.OK, db:errmsg())
+    end
     
     sql.block_get = assert(db:prepare("SELECT * FROM blocks WHERE hash = ?"), db:errmsg())
+    block_get_many = Multiget.prepare(db, "SELECT * FROM blocks WHERE hash")
     
-    sql.block_get_by_previous = assert(db:prepare("SELECT * FROM blocks WHERE previous = ?"), db:errmsg())
-    sql.block_get_by_source = assert(db:prepare("SELECT * FROM blocks WHERE source = ?"), db:errmsg())
+    successor_get_many = Multiget.prepare(db, "SELECT s.hash AS successor_of, blocks.* FROM block_successors s JOIN blocks ON blocks.hash = s.next WHERE s.kind = 0 AND s.hash")
+    sql.block_get_successor = assert(db:prepare("SELECT blocks.* FROM block_successors s JOIN blocks ON blocks.hash = s.next WHERE s.hash = ? AND s.kind = ?"), db:errmsg())
+    sql.successor_set = assert(db:prepare("INSERT OR IGNORE INTO block_successors (hash, kind, next) VALUES(?, ?, ?)"), db:errmsg())
+    sql.get_child_hashes = assert(db:prepare("SELECT next FROM block_successors WHERE hash = ?"), db:errmsg())
     
     sql.block_set = assert(db:prepare("INSERT OR REPLACE INTO blocks " ..
          "(hash, account, signature, valid, type, previous, source, representative, destination, balance, work, timestamp, genesis_distance) " ..
@@ -315,22 +472,60 @@ return {
          "(hash, account, signature, valid, type, previous, source, representative, destination, balance, work, timestamp, genesis_distance) " ..
       "VALUES(?,       ?,         ?,     ?,    ?,        ?,      ?,              ?,           ?,       ?,    ?,         ?,                ?)", db:errmsg()))
     
-    sql.block_update_ledger_validation = assert(db:prepare("UPDATE blocks SET valid = ?, genesis_distance = ? WHERE hash = ?"), db:errmsg())
+    --already-stored blocks keep their validation state: same hash, same block
+    sql.import_bootstrap_range = assert(db:prepare("INSERT OR IGNORE INTO blocks " ..
+         "(hash, account, signature, valid, type, previous, source, representative, destination, balance, work, timestamp, genesis_distance) " ..
+      "SELECT hash, account, signature, valid, type, previous, source, representative, destination, balance, work, timestamp, genesis_distance " ..
+      "FROM disktmp.blocks WHERE rowid >= ? AND rowid < ? ORDER BY hash"), db:errmsg())
+    
+    for what, kind in pairs(successor_kind) do
+      table.insert(import_successors_range, assert(db:prepare(("INSERT OR IGNORE INTO block_successors (hash, kind, next) " ..
+        "SELECT %s, %i, hash FROM disktmp.blocks WHERE rowid >= ? AND rowid < ? AND %s IS NOT NULL"):format(what, kind, what)), db:errmsg()))
+    end
+    
+    sql.bootstrap_range_hashes = assert(db:prepare("SELECT hash FROM disktmp.blocks WHERE rowid >= ? AND rowid < ?"), db:errmsg())
+    sql.bootstrap_range_accounts = assert(db:prepare("SELECT DISTINCT account FROM disktmp.blocks WHERE rowid >= ? AND rowid < ?"), db:errmsg())
+    
+    sql.block_update_ledger_validation = assert(db:prepare("UPDATE blocks SET valid = ?, genesis_distance = ?, balance = ? WHERE hash = ?"), db:errmsg())
     
     sql.find_open_by_account = assert(db:prepare("SELECT * FROM blocks WHERE type = 'open' AND account = ? LIMIT 1"), db:errmsg())
-    sql.find_by_previous = assert(db:prepare("SELECT * FROM blocks WHERE previous = ?"), db:errmsg())
-    sql.find_by_source = assert(db:prepare("SELECT * FROM blocks WHERE source = ?"), db:errmsg())
     
     sql.blocks_count = assert(db:prepare("SELECT COUNT(*) FROM blocks"), db:errmsg())
     sql.blocks_count_valid = assert(db:prepare("SELECT COUNT(*) FROM blocks WHERE valid >= ?"), db:errmsg())
     sql.bootstrapped_blocks_count = assert(db:prepare("SELECT COUNT(*) FROM disktmp.blocks"), db:errmsg())
     
+    do --the filter saved at the last clean shutdown, if it still matches the table
+      bloom_path = config.data.path .. "/blocks.bloom"
+      local rows, vm = db:urows("SELECT COUNT(*) FROM blocks")
+      local block_count = rows(vm)
+      local saved, saved_count = Bloom.load(bloom_path)
+      --an unclean exit from here on mustn't leave a stale filter around to be loaded next time
+      os.remove(bloom_path)
+      if saved and saved_count == block_count and saved:capacity() >= block_count then
+        bloom = saved
+      else
+        bloom_rebuild(math.max(block_count * 2, 1000000))
+      end
+    end
+    
     setmetatable(Block, BlockDB_meta)
   end,
   
   shutdown = function()
+    do
+      local rows, vm = db:urows("SELECT COUNT(*) FROM blocks")
+      local ok, err = bloom:save(bloom_path, rows(vm))
+      if not ok then
+        log:warn("blockdb: %s", err)
+      end
+    end
     for _, stmt in pairs(sql) do
       stmt:finalize()
     end
+    Multiget.finalize(block_get_many)
+    Multiget.finalize(successor_get_many)
+    for _, stmt in ipairs(import_successors_range) do
+      stmt:finalize()
+    end
   end,
 }
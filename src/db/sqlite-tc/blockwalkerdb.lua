@@ -1,82 +1,49 @@
 local sqlite3 = require "lsqlite3"
-local log = require "prailude.log"
+local PageFile = require "prailude.util.pagefile"
+local config = require "prailude.config"
 local BlockWalker
 
-local schema = function(tbl_type, tbl_name)
-  local _, tbl = tbl_name:match("^(.+%.)(.+)")
-  if not tbl then tbl = tbl_name end
-  return [[
-  CREATE ]] .. tbl_type .. [[ IF NOT EXISTS ]] .. tbl_name .. [[ (
-    walk_id                  INTEGER,
-    page_id                  INTEGER,
-    acct                     TEXT
-  );
-  CREATE UNIQUE INDEX IF NOT EXISTS ]] .. tbl_name .. [[_unique_acct_idx       ON ]] .. tbl .. [[ (walk_id, acct);
-  CREATE INDEX IF NOT EXISTS ]] .. tbl_name ..        [[_page_idx               ON ]] .. tbl .. [[ (page_id);
-  CREATE INDEX IF NOT EXISTS ]] .. tbl_name ..        [[_walk_idx               ON ]] .. tbl .. [[ (walk_id);
-]]
-
-end
-
 local db
 
-local sql = {}
+--spilled walk pages go into per-walk scratch files of packed account ids, not the db.
+-- a walk's pages never outlive the walk, so there's nothing here worth a transaction
+local pagefiles = {}
+
+local function pagefile(walk_id)
+  local pf = pagefiles[walk_id]
+  if not pf then
+    pf = assert(PageFile.open(("%s/walk-%d.pages"):format(config.data.path, walk_id), 5000))
+    pagefiles[walk_id] = pf
+  end
+  return pf
+end
 
 local BlockWalkerDB_meta = {__index = {
   store_page = function(walk_id, page_id, batch)
-    local stmt = sql.store
-    assert(db:exec("BEGIN EXCLUSIVE TRANSACTION") == sqlite3.OK, db:errmsg())
-    for _, acct_id in ipairs(batch) do
-      stmt:bind(1, walk_id)
-      stmt:bind(2, page_id)
-      stmt:bind(3, acct_id)
-      stmt:step()
-      stmt:reset()
-    end
-    assert(db:exec("COMMIT TRANSACTION") == sqlite3.OK, db:errmsg())
+    return pagefile(walk_id):store(page_id, batch)
   end,
   
   restore_page = function(walk_id, page_id)
-    local items = {}
-    local stmt = sql.get_page
-    stmt:bind(1, walk_id)
-    stmt:bind(2, page_id)
-    for acct_id in stmt:urows() do
-      table.insert(items, acct_id)
-    end
-    stmt:reset()
-    
-    stmt = sql.delete_page
-    stmt:bind(1, walk_id)
-    stmt:bind(2, page_id)
-    stmt:reset()
-    
-    return items
+    --the page's slots are freed as it's read back
+    return pagefile(walk_id):load(page_id)
   end,
   
   get_page_size = function(walk_id, page_id)
-    --TODO: cache maybe? eh...
-    local stmt = sql.page_size
-    stmt:bind(1, walk_id)
-    stmt:bind(2, page_id)
-    return stmt:urows()(stmt) or 0
+    local pf = pagefiles[walk_id]
+    return pf and pf:size(page_id) or 0
   end,
   
   delete_page = function(walk_id, page_id)
-    local stmt = sql.delete_page
-    stmt:bind(1, walk_id)
-    stmt:bind(2, page_id)
-    stmt:step()
-    stmt:reset()
-    return db:changes()
+    local pf = pagefiles[walk_id]
+    return pf and pf:delete(page_id) or 0
   end,
   
   delete = function(walk_id)
-    local stmt = sql.delete
-    stmt:bind(1, walk_id)
-    stmt:step()
-    stmt:reset()
-    return db:changes()
+    local pf = pagefiles[walk_id]
+    if pf then
+      pf:close()
+      pagefiles[walk_id] = nil
+    end
   end
 }}
 
@@ -85,22 +52,15 @@ return {
     BlockWalker = require "prailude.blockwalker"
     db = shared_db
     
-    assert(db:exec(schema("TABLE", "blockwalker")) == sqlite3.OK, db:errmsg())
-    
-    sql.store = assert(db:prepare("INSERT OR IGNORE INTO blockwalker (walk_id, page_id, acct) VALUES(?, ?, ?)"), db:errmsg())
-    
-    sql.page_size = assert(db:prepare("SELECT COUNT(*) FROM blockwalker WHERE walk_id = ? AND page_id = ?"), db:errmsg())
-    sql.get_page = assert(db:prepare("SELECT acct FROM blockwalker WHERE walk_id = ? AND page_id = ?"), db:errmsg())
-    sql.delete_page = assert(db:prepare("DELETE FROM blockwalker WHERE walk_id = ? AND page_id = ?"), db:errmsg())
-    
-    sql.delete = assert(db:prepare("DELETE FROM blockwalker WHERE walk_id = ?"), db:errmsg())
+    --walk pages used to be spilled into this table
+    assert(db:exec("DROP TABLE IF EXISTS blockwalker") == sqlite3.OK, db:errmsg())
 
     setmetatable(BlockWalker, BlockWalkerDB_meta)
   end,
   shutdown = function()
-    --save previously known peers
-    for _, stmt in pairs(sql) do
-      stmt:finalize()
+    for walk_id, pf in pairs(pagefiles) do
+      pf:close()
+      pagefiles[walk_id] = nil
     end
   end
 }
@@ -1,25 +1,32 @@
 local Frontier
 local sqlite3 = require "lsqlite3"
 
+--merged frontiers, one row per account. they arrive sorted by account from Frontier.merge_pulls,
+-- so these are plain appends to the b-tree
 local function schema(tbl_type, tbl_name)
-  local _, tbl = tbl_name:match("^(.+%.)(.+)")
-  if not tbl then tbl = tbl_name end
-  
   return [[
     CREATE ]]..tbl_type..[[ IF NOT EXISTS ]]..tbl_name..[[ (
-      account           TEXT,
-      frontier          TEXT,
-      stored_frontier   TEXT,
-      genesis_distance  INTEGER,
-      pull_id           INTEGER NOT NULL
-    );
-    CREATE UNIQUE INDEX IF NOT EXISTS ]]..tbl_name..[[_unique_idx ON ]]..tbl..[[ (account, frontier);
-    CREATE INDEX IF NOT EXISTS ]]..tbl_name..[[_frontier_idx      ON ]]..tbl..[[ (frontier);
-    CREATE INDEX IF NOT EXISTS ]]..tbl_name..[[_account_idx       ON ]]..tbl..[[ (account);
-    CREATE INDEX IF NOT EXISTS ]]..tbl_name..[[_pull_idx          ON ]]..tbl..[[ (pull_id);
+      account           BLOB,
+      frontier          BLOB,
+      stored_frontier   BLOB,
+      pull_id           INTEGER NOT NULL,
+      votes             INTEGER NOT NULL DEFAULT 1, --pulls that agreed on this frontier
+      conflict          INTEGER NOT NULL DEFAULT 0, --1 if some pulls had a different one
+      PRIMARY KEY(account)
+    ) WITHOUT ROWID;
   ]]
 end
 
+--accounts whose bulk pull finished and got staged, and the frontier they were pulled up to.
+-- a restarted bootstrap skips these
+local pulled_schema = [[
+  CREATE TABLE IF NOT EXISTS disktmp.pulled_accounts (
+    account             BLOB,
+    frontier            BLOB,
+    PRIMARY KEY(account)
+  ) WITHOUT ROWID;
+]]
+
 local sql = {}
 
 local db
@@ -30,6 +37,8 @@ local FrontierDB_meta = {__index = {
     stmt:bind(2, self.frontier)
     stmt:bind(3, self.stored_frontier)
     stmt:bind(4, self.pull_id)
+    stmt:bind(5, self.votes or 1)
+    stmt:bind(6, self.conflict and 1 or 0)
     stmt:step()
     stmt:reset()
     return self
@@ -53,9 +62,44 @@ local FrontierDB_meta = {__index = {
     for row in stmt:nrows() do
       table.insert(res, new(row))
     end
+    stmt:reset()
+    return res
+  end,
+  
+  --frontiers not yet pulled up to, in account order, starting after account `after`
+  get_unpulled_range = function(limit, after)
+    local stmt = sql.frontier_get_unpulled_range
+    stmt:bind(1, after or "")
+    stmt:bind(2, limit)
+    local new = Frontier.new
+    local res = {}
+    for row in stmt:nrows() do
+      table.insert(res, new(row))
+    end
+    stmt:reset()
     return res
   end,
   
+  --batch of {account=, frontier=}
+  mark_pulled = function(batch)
+    local stmt = sql.pulled_set
+    assert(db:exec("BEGIN EXCLUSIVE TRANSACTION") == sqlite3.OK, db:errmsg())
+    for _, pulled in ipairs(batch) do
+      stmt:bind(1, pulled.account)
+      stmt:bind(2, pulled.frontier)
+      stmt:step()
+      stmt:reset()
+    end
+    assert(db:exec("COMMIT TRANSACTION") == sqlite3.OK, db:errmsg())
+  end,
+  
+  count_pulled = function()
+    local stmt = sql.pulled_count
+    local n = stmt:urows()(stmt)
+    stmt:reset()
+    return n
+  end,
+  
   batch_store = function(batch, pull_id)
     assert(db:exec("BEGIN EXCLUSIVE TRANSACTION") == sqlite3.OK, db:errmsg())
     local store = Frontier.store
@@ -68,13 +112,9 @@ local FrontierDB_meta = {__index = {
     assert(db:exec("COMMIT TRANSACTION") == sqlite3.OK, db:errmsg())
   end,
   
-  delete_synced_frontiers = function()
-    assert(db:exec("DELETE from disktmp.frontier WHERE frontier == stored_frontier") == sqlite3.OK, db:errmsg())
-    return db:changes()
-  end,
-  
   clear_bootstrap = function()
-    assert(db:exec("DELETE FROM disktmp.frontier") == sqlite3.OK, db:errmsg())
+    assert(db:exec("DELETE FROM disktmp.frontiers") == sqlite3.OK, db:errmsg())
+    assert(db:exec("DELETE FROM disktmp.pulled_accounts") == sqlite3.OK, db:errmsg())
   end
 }}
 
@@ -82,16 +122,24 @@ return {
   initialize = function(db_ref)
     Frontier = require "prailude.frontier"
     db = db_ref
-    --assert(db:exec(schema("TABLE", "frontier")) == sqlite3.OK, db:errmsg())
-    assert(db:exec(schema("TABLE", "disktmp.frontier")) == sqlite3.OK, db:errmsg())
+    assert(db:exec("DROP TABLE IF EXISTS disktmp.frontier") == sqlite3.OK, db:errmsg()) --unmerged staging table, from before
+    assert(db:exec(schema("TABLE", "disktmp.frontiers")) == sqlite3.OK, db:errmsg())
+    assert(db:exec(pulled_schema) == sqlite3.OK, db:errmsg())
+    
+    sql.frontier_store = assert(db:prepare("INSERT OR REPLACE INTO disktmp.frontiers " ..
+      "      (account, frontier, stored_frontier, pull_id, votes, conflict) " ..
+      "VALUES(      ?,        ?,               ?,       ?,     ?,        ?);"), db:errmsg())
     
-    sql.frontier_store = assert(db:prepare("INSERT OR IGNORE INTO disktmp.frontier " ..
-      "      (account, frontier, stored_frontier, pull_id) " ..
-      "VALUES(      ?,        ?,               ?,       ?);"), db:errmsg())
+    sql.frontier_size = assert(db:prepare("SELECT count(*) FROM disktmp.frontiers"), db:errmsg())
     
-    sql.frontier_size = assert(db:prepare("SELECT count(*) FROM disktmp.frontier"), db:errmsg())
+    sql.frontier_get_range = assert(db:prepare("SELECT * FROM disktmp.frontiers ORDER BY account LIMIT ? OFFSET ?"), db:errmsg())
+    --keyset-paged, since the pulled set grows while this is being paged through
+    sql.frontier_get_unpulled_range = assert(db:prepare("SELECT f.* FROM disktmp.frontiers f WHERE f.account > ? " ..
+      "AND NOT EXISTS (SELECT 1 FROM disktmp.pulled_accounts p WHERE p.account = f.account AND p.frontier = f.frontier) " ..
+      "ORDER BY f.account LIMIT ?"), db:errmsg())
     
-    sql.frontier_get_range = assert(db:prepare("SELECT * FROM disktmp.frontier ORDER BY account LIMIT ? OFFSET ?"), db:errmsg())
+    sql.pulled_set = assert(db:prepare("INSERT OR REPLACE INTO disktmp.pulled_accounts (account, frontier) VALUES(?, ?)"), db:errmsg())
+    sql.pulled_count = assert(db:prepare("SELECT COUNT(*) FROM disktmp.pulled_accounts"), db:errmsg())
     
     setmetatable(Frontier, FrontierDB_meta)
   end,
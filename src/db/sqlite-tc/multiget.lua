@@ -0,0 +1,41 @@
+--batched key lookups: one prepared "WHERE key IN (?, ?, ...)" statement, stepped once
+-- per chunk of keys instead of once per key
+local sqlite3 = require "lsqlite3"
+
+local Multiget = {
+  chunk_size = 64
+}
+
+function Multiget.prepare(db, query_prefix, chunk_size)
+  chunk_size = chunk_size or Multiget.chunk_size
+  local placeholders = ("?, "):rep(chunk_size - 1) .. "?"
+  local stmt = assert(db:prepare(("%s IN (%s)"):format(query_prefix, placeholders)), db:errmsg())
+  return {stmt = stmt, chunk_size = chunk_size}
+end
+
+function Multiget.run(multiget, keys, row_callback)
+  local stmt, chunk_size = multiget.stmt, multiget.chunk_size
+  --sorted keys make each chunk a forward walk down the b-tree rather than random seeks
+  table.sort(keys)
+  local n = #keys
+  for chunk_start = 1, n, chunk_size do
+    for i = 1, chunk_size do
+      --unused slots are bound to NULL, which never matches
+      stmt:bind(i, keys[chunk_start + i - 1])
+    end
+    for row in stmt:nrows() do
+      row_callback(row)
+    end
+    stmt:reset()
+  end
+  return n
+end
+
+function Multiget.finalize(multiget)
+  if multiget.stmt:finalize() ~= sqlite3.OK then
+    return nil
+  end
+  return true
+end
+
+return Multiget
@@ -109,7 +109,6 @@ local PeerDB_meta = {__index = {
         local id = peer_id(peer_data.address, peer_data.port)
         table.insert(peers, cache:get(id) or Peer.new(peer_data))
       end
-      DBG(peers)
       return peers
     end
   end,
@@ -0,0 +1,95 @@
+local Snapshot
+local Account
+local Block
+local sqlite3 = require "lsqlite3"
+
+local sql = {}
+local db, DB
+
+local SnapshotDB_meta = {__index = {
+  --callback(block_count, account_count, each_block, each_account), all from the same read snapshot
+  read_ledger = function(callback)
+    Account.spill() --the accounts table has to have caught up with the ledger
+    local reader = assert(DB.open_reader("nano"))
+    local ok, nblocks, naccounts = pcall(DB.read_snapshot, reader, function(r)
+      local rows, vm = r:urows("SELECT COUNT(*) FROM blocks WHERE valid >= 3")
+      local block_count = rows(vm)
+      rows, vm = r:urows("SELECT COUNT(*) FROM accounts")
+      local account_count = rows(vm)
+      return callback(block_count, account_count, function()
+        return r:nrows("SELECT hash, account, previous, source, representative, destination, signature, balance, work, genesis_distance, timestamp, type, valid " ..
+                       "FROM blocks WHERE valid >= 3 ORDER BY hash")
+      end, function()
+        --the account's balance is its frontier's
+        return r:nrows("SELECT a.id, a.frontier, a.representative, a.delegated_balance, a.behind, a.block_count, b.balance " ..
+                       "FROM accounts a LEFT JOIN blocks b ON b.hash = a.frontier ORDER BY a.id")
+      end)
+    end)
+    reader:close()
+    if not ok then
+      error(nblocks, 0)
+    end
+    return nblocks, naccounts
+  end,
+
+  clear_ledger = function()
+    Account.clear()
+    Block.clear_ledger_validation()
+  end,
+  
+  store_blocks = function(batch)
+    local stmt = sql.block_set
+    assert(DB.transaction(db, function()
+      for _, b in ipairs(batch) do
+        stmt:bind(1, b.hash)
+        stmt:bind(2, b.account)
+        stmt:bind(3, b.signature)
+        stmt:bind(4, b.valid)
+        stmt:bind(5, b.type)
+        stmt:bind(6, b.previous)
+        stmt:bind(7, b.source)
+        stmt:bind(8, b.representative)
+        stmt:bind(9, b.destination)
+        stmt:bind(10, b.balance)
+        stmt:bind(11, b.work)
+        stmt:bind(12, b.timestamp)
+        stmt:bind(13, b.genesis_distance)
+        stmt:step()
+        stmt:reset()
+        Block.store_successors(b)
+        Block.mark_stored(b.hash)
+      end
+    end))
+  end,
+
+  store_accounts = function(batch)
+    assert(DB.transaction(db, function()
+      for _, data in ipairs(batch) do
+        Account.new(data):store()
+      end
+    end))
+  end
+}}
+
+return {
+  initialize = function(db_ref)
+    Snapshot = require "prailude.snapshot"
+    Account = require "prailude.account"
+    Block = require "prailude.block"
+    DB = require "prailude.db.sqlite-tc"
+    db = db_ref
+
+    --straight into the blocks table, no need to build Block objects for this
+    sql.block_set = assert(db:prepare("INSERT OR REPLACE INTO blocks " ..
+         "(hash, account, signature, valid, type, previous, source, representative, destination, balance, work, timestamp, genesis_distance) " ..
+      "VALUES(?,       ?,         ?,     ?,    ?,        ?,      ?,              ?,           ?,       ?,    ?,         ?,                ?)"), db:errmsg())
+
+    setmetatable(Snapshot, SnapshotDB_meta)
+  end,
+
+  shutdown = function()
+    for _, v in pairs(sql) do
+      v:finalize()
+    end
+  end
+}
@@ -181,13 +181,14 @@ local TCPSession_meta = {
         end
       end
       
+      self.tcp:read_stop() --a kept connection is still being watched for hangups
       self.tcp:read_start(function(read_err, chunk)
         if read_err then
           return self:stop(nil, read_err)
         end
         self.buf:push(chunk)
         if self.resume_coro_on_read then
-          rawset(self, "resume_session_on_read", nil)
+          rawset(self, "resume_coro_on_read", nil)
           return self:resume_session(chunk)
         end
       end)
@@ -210,10 +211,18 @@ local TCPSession_meta = {
       if self.session then
         self.session = nil
       end
+      --a session that ended cleanly and said the stream's in a good state leaves the
+      -- connection open for the next one, until the idle timer reaps it
+      local keep_connection = ok and self.keep_connection
+      self.keep_connection = nil
       if self.session_write_callback then
         self.session_write_callback = nil
       end
+      if self.idle_timer then
+        Timer.cancel(self.idle_timer)
+      end
       self.idle_timer = Timer.delay(self.idle_ttl, function()
+        self.idle_timer = nil
         if not self.session then
           if self.tcp then
             self.tcp:close()
@@ -238,8 +247,20 @@ local TCPSession_meta = {
       self.coro = nil
       
       if self.tcp then
-        self.tcp:close()
-        self.tcp = nil
+        if keep_connection and not self.tcp:is_closing() then
+          local tcp = self.tcp
+          tcp:read_stop()
+          --anything arriving while idle, even the peer hanging up, means the connection's no good anymore
+          tcp:read_start(function()
+            if self.tcp == tcp and not self.session then
+              tcp:close()
+              self.tcp = nil
+            end
+          end)
+        else
+          self.tcp:close()
+          self.tcp = nil
+        end
       end
       
       if coro and coroutine_status(coro) == "suspended" then
@@ -257,6 +278,13 @@ local TCPSession_meta = {
       end
     end,
     
+    --call from inside the session once the stream's between requests, to let the
+    -- next session on this peer reuse the connection
+    keepalive = function(self)
+      self.keep_connection = true
+      return self
+    end,
+    
     read = function(self)
       assert(coroutine_running() == self.session, "session coroutine not running!")
       rawset(self, "resume_coro_on_read", true)
@@ -92,103 +92,118 @@ function Account.is_instance(obj)
   return type(obj) == "table" and getmetatable(obj) == Account_meta
 end
 
-function Account.bulk_pull(frontier, peer, opt)
+--pull several accounts down one connection, keeping up to opt.window bulk_pull requests outstanding.
+-- the responses come back in request order, each one ending at its not-a-block marker.
+-- opt.next():                           the next frontier to request, or nil if there's nothing more for now
+-- opt.consume(batch, frontier, peer):   PoW- and signature-checked blocks. return nil, err to give up
+-- opt.finished(frontier, blocks_count, frontier_hash_found): all of an account's blocks are in
+-- opt.watchdog(blocks_so_far_count):    called every second. return false, err to give up
+-- returns the number of accounts finished, or nil, err. anything requested but not finished wasn't pulled
+function Account.bulk_pull_pipelined(peer, opt)
   if not Block then
     Block = require "prailude.block" --late require
   end
-  opt = opt or {}
-  assert(coroutine.running(), "Account.bulk_pull must be called in a coroutine")
-  local wanted_frontier = frontier.frontier
-  local acct = Account.get(frontier.account)
+  assert(coroutine.running(), "Account.bulk_pull_pipelined must be called in a coroutine")
+  local window = opt.window or 1
+  local pending = {}
+  local blocks_so_far_count, accounts_finished = 0, 0
   
-  local bulk_pull_message = Message.new("bulk_pull", {
-    account = acct.id,
-    frontier = acct.frontier
-  })
-
-  local blocks_so_far_count = 0
+  local function request(frontier)
+    local acct = Account.get(frontier.account)
+    table.insert(pending, {
+      frontier = frontier,
+      acct = acct,
+      blocks_count = 0,
+      frontier_hash_found = false,
+      message = Message.new("bulk_pull", {
+        account = acct.id,
+        frontier = acct.frontier
+      })
+    })
+  end
   
-  local watchdog = opt.watchdog
-  local function watchdog_wrapper()
-    return watchdog(blocks_so_far_count)
+  local first = opt.next()
+  if first == nil then
+    return 0 --nothing to do, don't bother connecting
   end
-  local frontier_hash_found = false
+  request(first)
   
-  local consume, result
-  do
-    local pubkey = acct.id
-    local function checkbatch(batch)
-      for _, block in ipairs(batch) do
-        if not block:verify_PoW() then
-          log:warn("bootstrap: got bad-PoW block from %s for acct %s: %s", tostring(peer), tostring(acct), block:to_json())
-          return nil, "bad PoW in batch_verify_signaturesaccount blocks"
-        end
-      end
-      local all_valid, block_valid = Block.batch_verify_signatures(batch, pubkey)
-      if not all_valid then
-        for _, v in ipairs(block_valid) do
-          if not v then
-            log:warn("bootstrap: got bad-sig block from %s for acct %s: %s", tostring(peer), tostring(acct), v.block:to_json())
-          end
-        end
-        return nil, "bad signature in account blocks"
-      else
-        return true
+  local function checkbatch(batch, acct)
+    for _, block in ipairs(batch) do
+      if not block:verify_PoW() then
+        log:warn("bootstrap: got bad-PoW block from %s for acct %s: %s", tostring(peer), tostring(acct), block:to_json())
+        return nil, "bad PoW in batch_verify_signaturesaccount blocks"
       end
     end
-    if not opt.consume then
-      local blocks_so_far = {}
-      consume = function(batch)
-        local ok, err = checkbatch(batch)
-        if not ok then return nil, err end
-        for _, b in ipairs(batch) do
-          table.insert(blocks_so_far, b)
+    local all_valid, block_valid = Block.batch_verify_signatures(batch, acct.id)
+    if not all_valid then
+      for _, v in ipairs(block_valid) do
+        if not v then
+          log:warn("bootstrap: got bad-sig block from %s for acct %s: %s", tostring(peer), tostring(acct), v.block:to_json())
         end
       end
-      result = function()
-        return blocks_so_far, frontier_hash_found
-      end
+      return nil, "bad signature in account blocks"
     else
-      consume = function(batch)
-        local ok, err = checkbatch(batch)
-        if not ok then return nil, err end
-        return opt.consume(batch, frontier, peer)
-      end
-      result = function()
-        return blocks_so_far_count, frontier_hash_found
-      end
+      return true
+    end
+  end
+  
+  local watchdog_wrapper
+  if opt.watchdog then
+    watchdog_wrapper = function()
+      return opt.watchdog(blocks_so_far_count)
     end
   end
   
   return peer:tcp_session("bulk pull", function(tcp)
-    tcp:write(bulk_pull_message:pack())
-    local fresh_blocks, leftovers_or_err, done
-    while tcp:read() do
-      local buf = tcp.buf:flush()
+    --top up the window, and send all the new requests in one write
+    local function send_requests()
+      while #pending < window do
+        local frontier = opt.next()
+        if frontier == nil then break end
+        request(frontier)
+      end
+      local out = {}
+      for _, req in ipairs(pending) do
+        if not req.sent then
+          table.insert(out, req.message:pack())
+          req.sent = true
+        end
+      end
+      if #out > 0 then
+        tcp:write(table.concat(out))
+      end
+    end
+    
+    send_requests()
+    local buf
+    while #pending > 0 and tcp:read() do
+      buf = tcp.buf:flush()
       --print("buf", #buf)
       --print(Util.bytes_to_hex_debug(buf))
       --print("")
-      fresh_blocks, leftovers_or_err, done = Parser.unpack_bulk(buf)
-      --print("fresh blocks", fresh_blocks and #fresh_blocks or "none", tostring(peer))
-      if not fresh_blocks then -- there was an error
-        --print("ERROR!", leftovers_or_err)
-        return nil, "error unpacking bulk blocks: " .. tostring(leftovers_or_err)
-      else
-        --got some new blocks?
-        if not done and #fresh_blocks == 0 and not leftovers_or_err then
+      repeat
+        local req = pending[1]
+        local fresh_blocks, leftovers_or_err, done = Parser.unpack_bulk(buf)
+        --print("fresh blocks", fresh_blocks and #fresh_blocks or "none", tostring(peer))
+        if not fresh_blocks then -- there was an error
+          --print("ERROR!", leftovers_or_err)
+          return nil, "error unpacking bulk blocks: " .. tostring(leftovers_or_err)
+        elseif not done and #fresh_blocks == 0 and not leftovers_or_err then
           --nope, no blocks here, and no leftovers either
           --pull failed?
           --print("no blocks here, and no leftovers either?...")
           return nil, "account pull produced 0 blocks"
-        else
-          --mm(fresh_blocks)
-          local ok, block, err
+        end
+        
+        if #fresh_blocks > 0 then
+          local wanted_frontier = req.frontier.frontier
           for i, blockdata in ipairs(fresh_blocks) do
             --mm(blockdata)
-            block, err = Block.new(blockdata)
+            local block, err = Block.new(blockdata)
             if block then
-              if not frontier_hash_found and block.hash == wanted_frontier then
-                frontier_hash_found = true
+              if not req.frontier_hash_found and block.hash == wanted_frontier then
+                req.frontier_hash_found = true
               end
               rawset(fresh_blocks, i, block)
             else
@@ -197,32 +212,80 @@ function Account.bulk_pull(frontier, peer, opt)
             end
             -- add the account to the block... it's quite useful this way
             if not block.account then
-              block.account = acct.id
+              block.account = req.acct.id
             end
           end
           
           blocks_so_far_count = blocks_so_far_count + #fresh_blocks
-          ok, err = consume(fresh_blocks)
+          req.blocks_count = req.blocks_count + #fresh_blocks
+          local ok, err = checkbatch(fresh_blocks, req.acct)
+          if ok then
+            ok, err = opt.consume(fresh_blocks, req.frontier, peer)
+          end
           if not ok then
             return  nil, err or "consume function returned nil but no error"
           end
-          
         end
-      end
-      if done then
-        break
-      elseif fresh_blocks and leftovers_or_err and #leftovers_or_err > 0 then
-        tcp.buf:push(leftovers_or_err)
-      end
+        
+        if done then
+          --log:debug("finished getting blocks for %s (%7d total) from %s", Account.to_readable(req.frontier.account), req.blocks_count, peer)
+          table.remove(pending, 1)
+          accounts_finished = accounts_finished + 1
+          if opt.finished then
+            opt.finished(req.frontier, req.blocks_count, req.frontier_hash_found)
+          end
+          send_requests()
+          --the next response may have started in the same read
+          buf = leftovers_or_err
+        else
+          if leftovers_or_err and #leftovers_or_err > 0 then
+            tcp.buf:push(leftovers_or_err)
+          end
+          buf = nil
+        end
+      until not buf or #buf == 0 or #pending == 0
     end
     
-    --log:debug("finished getting blocks for %s (%7d total) from %s", Account.to_readable(frontier.account), #blocks_so_far, peer)
-    -- no more blocks here
-    return result()
-    
+    if not buf or #buf == 0 then
+      --nothing past the end of the last response, so the next pull can go down the same connection
+      tcp:keepalive()
+    end
+    return accounts_finished
   end, watchdog_wrapper)
 end
 
+function Account.bulk_pull(frontier, peer, opt)
+  opt = opt or {}
+  local requested = false
+  local blocks_so_far = {}
+  local blocks_count, frontier_hash_found
+  local ok, err = Account.bulk_pull_pipelined(peer, {
+    next = function()
+      if not requested then
+        requested = true
+        return frontier
+      end
+    end,
+    consume = opt.consume or function(batch)
+      for _, b in ipairs(batch) do
+        table.insert(blocks_so_far, b)
+      end
+      return true
+    end,
+    finished = function(_, count, found)
+      blocks_count, frontier_hash_found = count, found
+    end,
+    watchdog = opt.watchdog
+  })
+  if not ok then
+    return nil, err
+  elseif opt.consume then
+    return blocks_count, frontier_hash_found
+  else
+    return blocks_so_far, frontier_hash_found
+  end
+end
+
 Account.burn = Account.new {id=Util.hex_to_bytes("0000000000000000000000000000000000000000000000000000000000000000")}
 
 ------------
@@ -189,7 +189,9 @@ local Block_instance = {
       end
     end
   
-    self.genesis_distance = (prev_block or source_block).genesis_distance + 1
+    --not every block's genesis_distance gets stored anymore, so this is best-effort
+    local parent_distance = (prev_block or source_block).genesis_distance
+    self.genesis_distance = parent_distance and parent_distance + 1 or nil
     self.valid = "ledger"
     return true
   end,
@@ -297,7 +299,15 @@ local Block_instance = {
       return Balance.genesis
     elseif self.balance then
       return self.balance
-    elseif blocktype == "open" then
+    end
+    --validated blocks have their balance stored, and the account's head balance is kept with the account.
+    -- deriving it from previous and source blocks is for everything else
+    local acct = self.account and Account.find(self.account)
+    if acct and acct.balance and acct.frontier == self.hash then
+      self.balance = acct.balance
+      return acct.balance
+    end
+    if blocktype == "open" then
       if self.balance then
         return self.balance
       else
@@ -331,6 +341,7 @@ local Block_instance = {
       if not parent_balance then
         error(("parent of block has no balance. block: %s. parent: %s"):format(self:debug(), parent:debug()))
       end
+      self.balance = parent_balance
       return parent_balance
     else
       error("unknown blocktype " .. tostring(blocktype) .. " for block " .. self:debug())
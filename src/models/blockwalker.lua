@@ -3,6 +3,7 @@ local Util =  require "prailude.util"
 local Account = require "prailude.account"
 local log = require "prailude.log"
 local DB = require "prailude.db"
+local coroutine = require "prailude.util.coroutine"
 
 local uniqueRunID; do
   -- since we're single-threaded and DB-exclusive, and walks are temporary data,
@@ -22,20 +23,55 @@ local BlockWalker_instance = {
   end,
   
   next = function(self)
-    local next_block = self.unvisited:next()
-    --print("BlockWalker NEXT!!!!!", Util.bytes_to_hex(next_block.hash))
-    if next_block then
-      return self.visit(next_block)
+    local next_acct = self.unvisited:next()
+    if next_acct then
+      return self.visit(next_acct)
     end
   end,
   
+  --more accounts to visit, from whatever's still feeding the walk. accounts parked on a gap get another go too
+  feed = function(self, accts)
+    local unvisited = self.unvisited
+    for _, acct in ipairs(accts or {}) do
+      unvisited:add(acct)
+    end
+    local waiting = self.waiting
+    self.waiting = {}
+    for _, acct in ipairs(waiting) do
+      unvisited:add(acct)
+    end
+    self.arrivals:check()
+    return self
+  end,
+  
+  --one wave of up to wave_size accounts per iteration
   each = function(self)
-    local unvisited, visit = self.unvisited, self.visit
+    local unvisited, visit_wave, more_coming = self.unvisited, self.visit_wave, self.more_coming
+    local wave_size = self.wave_size
     return function()
-      local next_block = unvisited:next()
-      if next_block then
-        return visit(next_block)
+      local next_acct = unvisited:next()
+      while not next_acct and more_coming() do
+        --out of work, but the walk isn't over until the feed is
+        self.arrivals:wait()
+        next_acct = unvisited:next()
+      end
+      if not next_acct then
+        if self.stats.parked > 0 then
+          log:warn("blockwalker: walk ended with %i accounts still waiting on a source block that never validated", self.stats.parked)
+        end
+        return nil
+      end
+      local wave, in_wave = {next_acct}, {[next_acct.id] = true}
+      while #wave < wave_size do
+        next_acct = unvisited:next()
+        if not next_acct then break end
+        --an account queued twice only needs to be in the wave once
+        if not in_wave[next_acct.id] then
+          in_wave[next_acct.id] = true
+          table.insert(wave, next_acct)
+        end
       end
+      return visit_wave(wave)
     end
   end,
   
@@ -54,7 +90,7 @@ local BlockWalker_instance = {
   finish = function(self)
     self.unvisited:stop()
     self.stop()
-    BlockWalker.delete_walk(self.id)
+    BlockWalker.delete(self.id)
     return self.id
   end
 }
@@ -81,6 +117,12 @@ function BlockWalker.new(data)
   
   local self = {
     direction = data.direction,
+    --true while blocks may still be arriving (see walker:feed). until then a gap is waited out, not pulled
+    more_coming = data.more_coming or function() return false end,
+    waiting = {}, --accounts parked on a gap
+    blocked = {}, --accounts waiting for a source block to be ledger-valid, by the source's hash
+    woken = {},   --accounts whose source just became valid, to rejoin the current wave
+    wave_size = data.wave_size or 500, --accounts verified side by side, their lookups batched together
   }
   
   local interrupt = data.interrupt or function() end
@@ -89,11 +131,11 @@ function BlockWalker.new(data)
   local unvisited = Util.PageQueue{
     id=self.id,
     pagesize = 5000,
-    store_item = function(item, state)
+    store_item = function(item, state, loaded)
       local itemtype = type(item)
       if state == "active" then
         if itemtype == "string" then -- we have an account id
-          return assert(Account.find(item))
+          return assert(loaded and loaded[item] or Account.find(item))
         else
           assert(Account.is_instance(item))
           return item
@@ -109,6 +151,15 @@ function BlockWalker.new(data)
         error("weird state: " .. tostring(state))
       end
     end,
+    load_items = function(items)
+      local ids = {}
+      for _, item in ipairs(items) do
+        if type(item) == "string" then
+          table.insert(ids, item)
+        end
+      end
+      return Account.find_many(ids)
+    end,
     store_page = BlockWalker.store_page,
     load_page = BlockWalker.restore_page,
     stored_page_size = assert(BlockWalker.get_page_size),
@@ -118,8 +169,12 @@ function BlockWalker.new(data)
     end
   }
   self.unvisited = unvisited
+  self.arrivals = coroutine.condition("blockwalker arrivals", function()
+    return unvisited:count() > 0 or not self.more_coming()
+  end)
   local stats = setmetatable({}, {__index = function() return 0 end})
   self.stats = stats
+  local blocked = self.blocked
   
   do
     local start = data.start
@@ -182,30 +237,62 @@ function BlockWalker.new(data)
       self.sink:add(rep)
     end
     
+    --advance the confirmation height. it only ever moves forward, one block at a time
     acct.behind = true
     acct.frontier = block.hash
+    acct.block_count = (acct.block_count or 0) + 1
+    acct.balance = block:get_balance()
     acct:save_later("frontier")
+    acct:save_later("block_count")
+    acct:save_later("balance")
     acct:save_later("behind")
     self.sink:add(acct)
   end
 
   
-  local function find_next_block_for_acct(acct)
-    assert(Account.is_instance(acct))
-    if acct.frontier then
-      return Block.find_block_by("previous", acct.frontier)
-    else
-      return Block.find_open_for_account(acct.id)
+  --the next block of each account in the wave, and everything verify_ledger is about to look up
+  -- for them, in a few batched reads instead of a couple of lookups per block.
+  -- the dependencies are held on to until the next wave, so the weak block cache doesn't drop them halfway through
+  local function fetch_wave(accts)
+    local frontiers = {}
+    for _, acct in ipairs(accts) do
+      if acct.frontier then
+        table.insert(frontiers, acct.frontier)
+      end
     end
-  end
-  
-  local function fast_forward(acct, n) --also verify up to n blocks in the same account with no unverified dependencies
-    --print("ffwd", n, acct:debug())
+    local successors = Block.find_next_many(frontiers)
+    
+    local next_blocks, dep_hashes = {}, {}
+    for _, acct in ipairs(accts) do
+      local block
+      if acct.frontier then
+        block = successors[acct.frontier]
+      else
+        block = Block.find_open_for_account(acct.id)
+      end
+      next_blocks[acct] = block or false
+      if block then
+        table.insert(dep_hashes, block.previous)
+        table.insert(dep_hashes, block.source)
+      end
+    end
+    local deps = Block.find_many(dep_hashes)
     
-    if n == 0 or not n then
-      return false, "retry_right_away"
+    --the send amounts of the sources need their previous blocks too
+    local source_prev_hashes = {}
+    for _, block in pairs(next_blocks) do
+      local source = block and block.source and deps[block.source]
+      if source and source.previous then
+        table.insert(source_prev_hashes, source.previous)
+      end
     end
-    local block = find_next_block_for_acct(acct)
+    self.wave_deps = {deps, Block.find_many(source_prev_hashes)}
+    return next_blocks
+  end
+  
+  --verify one block of the account's chain. true, "more" if there might be another one after it
+  local function advance(acct, block)
+    --print("advance", acct:debug())
     if not block then --we're up to date now
       acct.behind = false
       acct:save_later("behind")
@@ -221,6 +308,15 @@ function BlockWalker.new(data)
       self.sink:add(block)
       stats.verified = stats.verified + 1
       update_acct(acct, block)
+      --whoever was parked waiting on this block can go on now
+      local parked = blocked[block.hash]
+      if parked then
+        blocked[block.hash] = nil
+        for _, parked_acct in pairs(parked) do
+          stats.parked = stats.parked - 1
+          table.insert(self.woken, parked_acct)
+        end
+      end
       if block.type == "send" then
         local dst = block:get_destination()
         if dst and not dst:is_valid("ledger") then
@@ -230,23 +326,23 @@ function BlockWalker.new(data)
             self.sink:add(dst_acct)
           end
           if not dst_acct.behind then
+            --persisted, so an interrupted walk knows to come back to it
             dst_acct.behind = true
+            dst_acct:save_later("behind")
+            self.sink:add(dst_acct)
+          end
+          if not (parked and parked[dst_acct.id]) then --just woken up, no need to queue it again
+            unvisited:add(dst_acct)
           end
-          unvisited:add(dst_acct)
         end
       end
-      
-      local child = block:get_next()
-      if child then
-        --print("with child")
-        return fast_forward(acct, n-1)
-      else
-        return true, nil -- we're done here
-      end
+      return true, "more"
     elseif err == "retry" then
       --print("RETRY")
       stats.retry = stats.retry + 1
-      --unvisited:prepend(block)
+      --the source isn't ledger-valid yet. park the account on it, to be woken when it is,
+      -- and get the source's account going
+      local parked_on
       if block.source then
         local source = block:get_source()
         if source and not source:is_valid("ledger") then
@@ -256,6 +352,7 @@ function BlockWalker.new(data)
             self.sink:add(src_acct)
           end
           unvisited:prepend(src_acct)
+          parked_on = source.hash
         end
       end
       if block.previous then
@@ -268,7 +365,23 @@ function BlockWalker.new(data)
           error("y u no previous?")
         end
       end
+      if parked_on then
+        local parked = blocked[parked_on]
+        if not parked then
+          parked = {}
+          blocked[parked_on] = parked
+        end
+        if not parked[acct.id] then
+          parked[acct.id] = acct
+          stats.parked = stats.parked + 1
+        end
+        return false, "parked"
+      end
       return false, "retry"
+    elseif err == "gap" and self.more_coming() then
+      --the missing block is probably just not imported yet
+      stats.gap_wait = stats.gap_wait + 1
+      return false, "gap"
     elseif err == "gap" then
       print("GAP", err_details or "", block and block:debug())
       local gap_hash
@@ -304,24 +417,61 @@ function BlockWalker.new(data)
     end
   end
   
-  
-  self.visit = function(acct)
-    interrupt()
-    --print("VISIT", block:debug())
-    local ok, err = fast_forward(acct, 400)
-    if not ok then
-      if err == "retry" then --retry it again later maybe?
-        unvisited:add(acct)
-      elseif err == "retry_right_away" then
-        unvisited:prepend(acct)
-      else
-        --log:error(("validation failed on block %s: %s"):format(block and block:debug() or "unknown-block", err or "unknown-error"))
-        stats.failed = stats.failed + 1
+  --verify a wave of accounts, one block from each per round, in order. an account stays in the
+  -- wave until it's caught up, stuck, or has had max_steps blocks, then goes back in line
+  local max_steps = 400
+  self.visit_wave = function(accts)
+    local steps = {}
+    while #accts > 0 do
+      interrupt()
+      local next_blocks = fetch_wave(accts)
+      local continuing = {}
+      for _, acct in ipairs(accts) do
+        local ok, err = advance(acct, next_blocks[acct] or nil)
+        if ok then
+          if err == "more" then
+            steps[acct] = (steps[acct] or 0) + 1
+            if steps[acct] < max_steps then
+              table.insert(continuing, acct)
+            else
+              unvisited:prepend(acct)
+            end
+          end
+        elseif err == "retry" then --retry it again later maybe?
+          unvisited:add(acct)
+        elseif err == "gap" then
+          table.insert(self.waiting, acct)
+        elseif err ~= "parked" then --parked ones are in the wait-list now
+          --log:error(("validation failed on block %s: %s"):format(block and block:debug() or "unknown-block", err or "unknown-error"))
+          stats.failed = stats.failed + 1
+        end
+      end
+      accts = continuing
+      --accounts whose dependency validated this round pick up right where they were
+      local woken = self.woken
+      if #woken > 0 then
+        self.woken = {}
+        local in_wave = {}
+        for _, acct in ipairs(accts) do
+          in_wave[acct.id] = true
+        end
+        for _, acct in ipairs(woken) do
+          if not in_wave[acct.id] then
+            in_wave[acct.id] = true
+            table.insert(accts, acct)
+          end
+        end
       end
     end
+    self.wave_deps = nil
     return true
   end
   
+  self.visit = function(acct)
+    return self.visit_wave({acct})
+  end
+  
+
   --local batchnum = 0
   self.sink = Util.BatchSink{
     batch_size = 5000,
@@ -334,6 +484,7 @@ function BlockWalker.new(data)
             val.in_sink = nil
             val:save()
           else
+            --stores the block's balance along with its validation, so nothing needs to re-derive it later
             val:update_ledger_validation()
           end
         end
@@ -8,6 +8,7 @@ local Account = require "prailude.account"
 local Parser = require "prailude.util.parser"
 local NilDB = require "prailude.db.nil" -- no database
 local BatchSink = require "prailude.util".BatchSink
+local config = require "prailude.config"
 
 local Frontier_meta = {
   __index={
@@ -25,6 +26,7 @@ local Frontier = {}
 
 do
   local frontier_pulls = {}
+  local synced_count = 0
   
   function Frontier.new_pull_id(peer)
     table.insert(frontier_pulls, peer)
@@ -37,6 +39,13 @@ do
   
   function Frontier.clear_pulls()
     frontier_pulls={}
+    synced_count = 0
+  end
+  
+  --accounts where the pulls' majority frontier matched the local ledger, and so were never staged
+  function Frontier.count_synced(n)
+    synced_count = synced_count + (n or 0)
+    return synced_count
   end
   
   function Frontier.delete_pull_id(id)
@@ -45,10 +54,131 @@ do
   
   function Frontier.delete_pull(id)
     Frontier.delete_pull_id(id)
-    Frontier.delete_pull_data(id)
+    os.remove(Frontier.run_path(id))
+  end
+  
+  function Frontier.get_pull_ids()
+    local ids = {}
+    for id in pairs(frontier_pulls) do
+      table.insert(ids, id)
+    end
+    table.sort(ids)
+    return ids
+  end
+end
+
+--each frontier pull is written out as it arrives to its own run file of 64-byte
+-- (account, frontier) records. peers send frontiers sorted by account, so every run is
+-- already sorted, and merging them is a single streaming pass.
+local RUN_RECORD_SIZE = 64
+local RUN_READ_RECORDS = 1024
+
+function Frontier.run_path(pull_id)
+  return ("%s/frontier-run-%i.tmp"):format(config.data.path, pull_id)
+end
+
+local function run_writer(pull_id)
+  local f = assert(io.open(Frontier.run_path(pull_id), "wb"))
+  return function(batch)
+    local buf = {}
+    for i, frontier in ipairs(batch) do
+      buf[i] = frontier.account .. frontier.frontier
+    end
+    assert(f:write(table.concat(buf)))
+  end, function()
+    f:close()
+  end
+end
+
+local function run_reader(pull_id)
+  local f = assert(io.open(Frontier.run_path(pull_id), "rb"))
+  local buf, pos = "", 1
+  return function()
+    if pos > #buf then
+      buf, pos = f:read(RUN_RECORD_SIZE * RUN_READ_RECORDS), 1
+      if not buf then
+        f:close()
+        return nil
+      end
+    end
+    local p = pos
+    pos = p + RUN_RECORD_SIZE
+    return buf:sub(p, p + 31), buf:sub(p + 32, p + 63)
   end
 end
 
+--k-way merge of all the finished pulls' runs, one account at a time, with only a
+-- chunk of each run in memory. every account gets the frontier most pulls agree on,
+-- the number of pulls that agree, and whether any disagreed. only then is it diffed
+-- against the local ledger: accounts where the majority agrees with us are counted as
+-- synced, the rest go to consume(batch) and are staged for bulk pulls by default.
+function Frontier.merge_pulls(consume)
+  local pull_ids = Frontier.get_pull_ids()
+  local next_record, head_account, head_frontier = {}, {}, {}
+  for i, id in ipairs(pull_ids) do
+    next_record[i] = run_reader(id)
+    head_account[i], head_frontier[i] = next_record[i]()
+  end
+  local sink = BatchSink {
+    batch_size = 10000,
+    consume = consume or Frontier.batch_store
+  }
+  local merged, conflicts, synced = 0, 0, 0
+  local k = #pull_ids
+  while true do
+    local account
+    for i = 1, k do
+      local acct = head_account[i]
+      if acct and (not account or acct < account) then
+        account = acct
+      end
+    end
+    if not account then break end
+    
+    local votes, first_pull = {}, {}
+    local best, distinct = nil, 0
+    for i = 1, k do
+      if head_account[i] == account then
+        local frontier = head_frontier[i]
+        if not votes[frontier] then
+          votes[frontier] = 0
+          first_pull[frontier] = pull_ids[i]
+          distinct = distinct + 1
+        end
+        votes[frontier] = votes[frontier] + 1
+        if not best or votes[frontier] > votes[best] then
+          best = frontier
+        end
+        head_account[i], head_frontier[i] = next_record[i]()
+      end
+    end
+    
+    local stored_frontier = Account.get_frontier(account)
+    if stored_frontier == best then
+      synced = synced + 1
+    else
+      merged = merged + 1
+      if distinct > 1 then
+        conflicts = conflicts + 1
+      end
+      sink:add(Frontier.new {
+        account = account,
+        frontier = best,
+        stored_frontier = stored_frontier,
+        pull_id = first_pull[best],
+        votes = votes[best],
+        conflict = distinct > 1
+      })
+    end
+  end
+  sink:finish()
+  Frontier.count_synced(synced)
+  for _, id in ipairs(pull_ids) do
+    os.remove(Frontier.run_path(id))
+  end
+  return merged, conflicts
+end
+
 function Frontier.new(data, peer)
   if peer then
     data.source_peer = tostring(peer)
@@ -56,7 +186,9 @@ function Frontier.new(data, peer)
   return setmetatable((data or {}), Frontier_meta)
 end
   
-function Frontier.fetch(peer, watchdog_callback)
+--every frontier the peer sends goes to consume(batch), which writes it to the pull's run file by default.
+-- they're only diffed against the local ledger once the pulls have voted, in merge_pulls
+function Frontier.fetch(peer, watchdog_callback, consume)
   assert(coroutine.running(), "Frontier.fetch must be called in a coroutine")
   local frontier_req = Message.new("frontier_req")
   
@@ -66,10 +198,15 @@ function Frontier.fetch(peer, watchdog_callback)
   end
   
   local pull_id = Frontier.new_pull_id(peer)
+  local close_run
+  if not consume then
+    consume, close_run = run_writer(pull_id)
+  end
   local sink = BatchSink {
     batch_size = 10000,
-    consume = Frontier.batch_store
+    consume = consume
   }
+  local last_account = ""
   
   local res, err = peer:tcp_session("frontier pull", function(tcp)
     tcp:write(frontier_req:pack())
@@ -84,8 +221,11 @@ function Frontier.fetch(peer, watchdog_callback)
         end
         --got some new frontiers
         for _, frontier in ipairs(fresh_frontiers) do
+          if frontier.account <= last_account then
+            return nil, "frontiers not sorted by account"
+          end
+          last_account = frontier.account
           frontier.pull_id = pull_id
-          frontier.stored_frontier = Account.get_frontier(frontier.account)
           sink:add(Frontier.new(frontier))
         end
         frontiers_count_so_far = frontiers_count_so_far + #fresh_frontiers
@@ -100,9 +240,12 @@ function Frontier.fetch(peer, watchdog_callback)
       end
     end
   end, watchdog_wrapper)
+  if close_run then
+    close_run()
+  end
   
   if not res then
-    Frontier.delete_pull_id(pull_id)
+    Frontier.delete_pull(pull_id)
     return nil, err
   else
     return pull_id, err
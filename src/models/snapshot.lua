@@ -0,0 +1,322 @@
+local log = require "prailude.log"
+local Util = require "prailude.util"
+local Balance = require "prailude.util.balance"
+local NilDB = require "prailude.db.nil" -- no database
+
+--ledger snapshot file: everything ledger-valid, plus account state, so a new node can start from it
+-- instead of bootstrapping from genesis.
+--
+-- layout, all integers big-endian:
+--   header (64 bytes)
+--   block records, fixed-size, sorted by hash
+--   account records, fixed-size, sorted by id
+--   trailer: blake2b-512 of everything before it (64 bytes)
+--
+-- fixed-size records at 8-byte-aligned offsets, so a reader can mmap the file and
+-- binary-search either section directly. the writer streams records out in one pass.
+
+local Snapshot = {}
+local blake2b = Util.blake2b
+
+local MAGIC = "PRLDSNAP"
+local VERSION = 1
+local HEADER_SIZE = 64
+local TRAILER_SIZE = 64
+local BLOCK_RECORD_SIZE = 304
+local ACCOUNT_RECORD_SIZE = 144
+local CHUNK_SIZE = 1024 * 1024
+
+Snapshot.BLOCK_RECORD_SIZE = BLOCK_RECORD_SIZE
+Snapshot.ACCOUNT_RECORD_SIZE = ACCOUNT_RECORD_SIZE
+
+local ACCOUNT_BEHIND = 1
+local ACCOUNT_HAS_BALANCE = 2
+
+local typecode = {send = 2, receive = 3, open = 4, change = 5}
+local typename = {}
+for k, v in pairs(typecode) do typename[v]=k end
+
+local floor = math.floor
+local char = string.char
+local zero32, zero64 = ("\0"):rep(32), ("\0"):rep(64)
+local zero16, zero8 = ("\0"):rep(16), ("\0"):rep(8)
+
+local function u32(n)
+  return char(floor(n / 2^24) % 256, floor(n / 2^16) % 256, floor(n / 2^8) % 256, n % 256)
+end
+local function u64(n) --good up to 2^53, which is plenty
+  return u32(floor(n / 2^32)) .. u32(n % 2^32)
+end
+local function get_u32(str, pos)
+  local a, b, c, d = str:byte(pos, pos + 3)
+  return ((a * 256 + b) * 256 + c) * 256 + d
+end
+local function get_u64(str, pos)
+  return get_u32(str, pos) * 2^32 + get_u32(str, pos + 4)
+end
+
+local function fixed(str, len, what)
+  if str == nil then
+    return len == 32 and zero32 or len == 16 and zero16 or len == 8 and zero8 or zero64
+  end
+  assert(#str == len, what .. " must be " .. len .. " bytes")
+  return str
+end
+local function nonzero(str)
+  if str:match("^%z+$") then
+    return nil
+  end
+  return str
+end
+
+local function header(nblocks, naccounts)
+  return table.concat {
+    MAGIC, u32(VERSION), u32(BLOCK_RECORD_SIZE), u32(ACCOUNT_RECORD_SIZE), u32(0),
+    u64(nblocks), u64(naccounts), u64(os.time()),
+    ("\0"):rep(16)
+  }
+end
+
+local function parse_header(hdr)
+  if not hdr or #hdr < HEADER_SIZE or hdr:sub(1, 8) ~= MAGIC then
+    return nil, "not a ledger snapshot"
+  end
+  local version = get_u32(hdr, 9)
+  if version ~= VERSION then
+    return nil, ("unsupported ledger snapshot version %i"):format(version)
+  end
+  if get_u32(hdr, 13) ~= BLOCK_RECORD_SIZE or get_u32(hdr, 17) ~= ACCOUNT_RECORD_SIZE then
+    return nil, "unexpected ledger snapshot record sizes"
+  end
+  return {
+    version = version,
+    blocks = get_u64(hdr, 25),
+    accounts = get_u64(hdr, 33),
+    created = get_u64(hdr, 41)
+  }
+end
+
+--rows as they come out of the blocks table
+function Snapshot.pack_block(row)
+  local balance = row.balance
+  if type(balance) == "userdata" then
+    balance = balance:pack()
+  end
+  local valid = row.valid
+  if type(valid) == "string" then
+    valid = valid == "confirmed" and 4 or 3
+  elseif not valid or valid < 3 then
+    valid = 3 --everything in a snapshot is ledger-valid, whether it was marked individually or not
+  end
+  return table.concat {
+    fixed(row.hash, 32, "hash"),
+    fixed(row.account, 32, "account"),
+    fixed(row.previous, 32, "previous"),
+    fixed(row.source, 32, "source"),
+    fixed(row.representative, 32, "representative"),
+    fixed(row.destination, 32, "destination"),
+    fixed(row.signature, 64, "signature"),
+    fixed(balance, 16, "balance"),
+    fixed(row.work, 8, "work"),
+    u64(tonumber(row.genesis_distance) or 0),
+    u64(floor(tonumber(row.timestamp) or 0)),
+    char(assert(typecode[row.type], "unknown block type"), valid),
+    ("\0"):rep(6)
+  }
+end
+
+function Snapshot.unpack_block(rec, pos)
+  pos = pos or 1
+  local sub = rec.sub
+  local balance = sub(rec, pos + 256, pos + 271)
+  local btype, valid = rec:byte(pos + 296, pos + 297)
+  return {
+    hash =              sub(rec, pos, pos + 31),
+    account =           sub(rec, pos + 32, pos + 63),
+    previous =          nonzero(sub(rec, pos + 64, pos + 95)),
+    source =            nonzero(sub(rec, pos + 96, pos + 127)),
+    representative =    nonzero(sub(rec, pos + 128, pos + 159)),
+    destination =       nonzero(sub(rec, pos + 160, pos + 191)),
+    signature =         sub(rec, pos + 192, pos + 255),
+    --sends always have a balance. for the rest, zeroes means we didn't know it
+    balance =           (btype == typecode.send or nonzero(balance)) and balance or nil,
+    work =              sub(rec, pos + 272, pos + 279),
+    genesis_distance =  get_u64(rec, pos + 280),
+    timestamp =         nonzero(sub(rec, pos + 288, pos + 295)) and get_u64(rec, pos + 288) or nil,
+    type =              assert(typename[btype], "unknown block type in snapshot"),
+    valid =             valid
+  }
+end
+
+local function pack_weight(num) --delegated_balance is a double. the raw integer is good enough
+  num = tonumber(num)
+  if not num or num <= 0 then
+    return zero16
+  end
+  return Balance.new(("%.0f"):format(math.min(num, 2^128 - 2^75)), "raw"):pack() --largest double under 2^128
+end
+
+function Snapshot.pack_account(row)
+  local flags = 0
+  local behind = row.behind
+  if behind and behind ~= 0 and behind ~= "0" then
+    flags = flags + ACCOUNT_BEHIND
+  end
+  local balance = row.balance
+  if type(balance) == "userdata" then
+    balance = balance:pack()
+  end
+  if balance then
+    flags = flags + ACCOUNT_HAS_BALANCE
+  end
+  return table.concat {
+    fixed(row.id, 32, "account id"),
+    fixed(row.frontier, 32, "frontier"),
+    fixed(row.representative, 32, "representative"),
+    fixed(balance, 16, "balance"),
+    pack_weight(row.delegated_balance),
+    u64(tonumber(row.block_count) or 0),
+    u32(flags),
+    u32(0)
+  }
+end
+
+function Snapshot.unpack_account(rec, pos)
+  pos = pos or 1
+  local sub = rec.sub
+  local flags = get_u32(rec, pos + 136)
+  local weight = nonzero(sub(rec, pos + 112, pos + 127))
+  return {
+    id =                sub(rec, pos, pos + 31),
+    frontier =          nonzero(sub(rec, pos + 32, pos + 63)),
+    representative =    nonzero(sub(rec, pos + 64, pos + 95)),
+    balance =           flags % 4 >= ACCOUNT_HAS_BALANCE and sub(rec, pos + 96, pos + 111) or nil,
+    delegated_balance = weight and tonumber(tostring(Balance.unpack(weight))) or nil,
+    block_count =       get_u64(rec, pos + 128),
+    behind =            flags % 2 == ACCOUNT_BEHIND
+  }
+end
+
+--write out the current ledger. everything's read from one consistent db snapshot,
+-- so this can run while the node keeps going
+function Snapshot.write(path)
+  local tmppath = path .. ".tmp"
+  local f, err = io.open(tmppath, "wb")
+  if not f then
+    return nil, err
+  end
+  local hash = blake2b.init()
+  local buf, buflen = {}, 0
+  local function write(data)
+    table.insert(buf, data)
+    buflen = buflen + #data
+    if buflen >= CHUNK_SIZE then
+      data = table.concat(buf)
+      blake2b.update(hash, data)
+      assert(f:write(data))
+      buf, buflen = {}, 0
+    end
+  end
+
+  local ok, nblocks, naccounts = pcall(Snapshot.read_ledger, function(block_count, account_count, each_block, each_account)
+    write(header(block_count, account_count))
+    local nb, na = 0, 0
+    for row in each_block() do
+      write(Snapshot.pack_block(row))
+      nb = nb + 1
+    end
+    for row in each_account() do
+      write(Snapshot.pack_account(row))
+      na = na + 1
+    end
+    assert(nb == block_count and na == account_count, "ledger changed while writing snapshot")
+    return nb, na
+  end)
+  if ok then
+    local data = table.concat(buf)
+    blake2b.update(hash, data)
+    ok, err = f:write(data, blake2b.final(hash))
+  else
+    err = nblocks
+  end
+  f:close()
+  if not ok then
+    os.remove(tmppath)
+    return nil, err
+  end
+  ok, err = os.rename(tmppath, path)
+  if not ok then
+    return nil, err
+  end
+  log:debug("snapshot: wrote %i blocks and %i accounts to %s", nblocks, naccounts, path)
+  return nblocks, naccounts
+end
+
+--check the whole file against its trailer checksum, before anything gets loaded from it
+function Snapshot.verify(path)
+  local f, err = io.open(path, "rb")
+  if not f then
+    return nil, err
+  end
+  local hdr = f:read(HEADER_SIZE)
+  local info
+  info, err = parse_header(hdr)
+  if not info then
+    f:close()
+    return nil, err
+  end
+  local size = f:seek("end")
+  local expected_size = HEADER_SIZE + info.blocks * BLOCK_RECORD_SIZE + info.accounts * ACCOUNT_RECORD_SIZE + TRAILER_SIZE
+  if size ~= expected_size then
+    f:close()
+    return nil, ("ledger snapshot size is %i, expected %i"):format(size, expected_size)
+  end
+  f:seek("set", 0)
+  local hash = blake2b.init()
+  local left = size - TRAILER_SIZE
+  while left > 0 do
+    local chunk = f:read(math.min(left, CHUNK_SIZE))
+    blake2b.update(hash, chunk)
+    left = left - #chunk
+  end
+  local trailer = f:read(TRAILER_SIZE)
+  f:close()
+  if trailer ~= blake2b.final(hash) then
+    return nil, "ledger snapshot checksum mismatch"
+  end
+  return info
+end
+
+--replace the local ledger with the snapshot's. its blocks are trusted as ledger-valid and won't be re-verified
+function Snapshot.load(path, batch_size)
+  local info, err = Snapshot.verify(path)
+  if not info then
+    return nil, err
+  end
+  batch_size = batch_size or 10000
+  local f = assert(io.open(path, "rb"))
+  f:seek("set", HEADER_SIZE)
+
+  local function each_record(count, size, unpack, store)
+    local left = count
+    while left > 0 do
+      local n = math.min(left, batch_size)
+      local chunk = f:read(n * size)
+      local batch = {}
+      for i = 0, n - 1 do
+        table.insert(batch, unpack(chunk, i * size + 1))
+      end
+      store(batch)
+      left = left - n
+    end
+  end
+
+  Snapshot.clear_ledger()
+  each_record(info.blocks, BLOCK_RECORD_SIZE, Snapshot.unpack_block, Snapshot.store_blocks)
+  each_record(info.accounts, ACCOUNT_RECORD_SIZE, Snapshot.unpack_account, Snapshot.store_accounts)
+  f:close()
+  log:debug("snapshot: loaded %i blocks and %i accounts from %s", info.blocks, info.accounts, path)
+  return info.blocks, info.accounts
+end
+
+return setmetatable(Snapshot, NilDB.snapshot)
@@ -9,6 +9,7 @@ local Account = require "prailude.account"
 local Message = require "prailude.message"
 local Block = require "prailude.block"
 local BlockWalker = require "prailude.blockwalker"
+local Snapshot = require "prailude.snapshot"
 local Vote = require "prailude.vote"
 local Util = require "prailude.util"
 local Parser = require "prailude.util.parser"
@@ -133,40 +134,56 @@ end
 
 function Nanonet.bootstrap()
   local gettime = require "prailude.util.lowlevel".gettime
-  local maybe_interrupt; do
-    local clock = os.clock
-    maybe_interrupt = function(n_max)
-      local tw0 = clock()
-      local n = 0
-      n_max = n_max or 5
-      return function()
-        n = n+1
-        if n > n_max then
-          n=0
-          if clock() - tw0 > 0.5 then
-            Timer.delay(10)
-            tw0=clock()
-          end
-        end
-      end
-    end
-  end
-  
   local coro = coroutine.create(function()
     --let's gather some peers first. 50 active peers should be enough
     
     local fetch, import, verify = true, true, true
+    --pull, import and verify all at once instead of one after the other
+    local pipelined = fetch and import and verify
     
-    if fetch then
+    --how far an interrupted bootstrap got: "pulling", "importing", "verifying", or "done" when it wasn't interrupted
+    local checkpoint = DB.kv.get("bootstrap:checkpoint")
+    local resuming = fetch and checkpoint ~= nil and checkpoint ~= "done"
+    local stage_order = {pulling = 1, importing = 2, verifying = 3}
+    local function past(stage) --already done in the bootstrap being resumed
+      return resuming and stage_order[checkpoint] > stage_order[stage]
+    end
+    local function set_checkpoint(stage)
+      checkpoint = stage
+      DB.kv.set("bootstrap:checkpoint", stage)
+    end
+    
+    --a resumed bootstrap keeps whatever ledger the interrupted one started from
+    local from_snapshot = resuming and DB.kv.get("bootstrap:from_snapshot") == "1"
+    if config.bootstrap.snapshot and not resuming then
+      log:debug("bootstrap: loading ledger snapshot %s...", config.bootstrap.snapshot)
+      local nblocks, naccounts = Snapshot.load(config.bootstrap.snapshot)
+      if nblocks then
+        log:debug("bootstrap: loaded %i blocks and %i accounts from snapshot", nblocks, naccounts)
+        from_snapshot = true
+      else
+        log:warn("bootstrap: can't use ledger snapshot: %s", naccounts)
+      end
+    end
+    if not resuming then
+      DB.kv.set("bootstrap:from_snapshot", from_snapshot and "1" or nil)
+    end
+    
+    if resuming then
+      log:debug("bootstrap: resuming interrupted bootstrap, %i of %i accounts already pulled", Frontier.count_pulled(), Frontier.get_size())
+    elseif fetch then
       log:debug("bootstrap: preparing database...")
       Frontier.clear_bootstrap()
+      Frontier.clear_pulls()
       Block.clear_bootstrap()
+      DB.kv.set("bootstrap:import_from", nil)
+      DB.kv.set("bootstrap:walking", nil)
     end
     
     local t0 = gettime()
     local t1, t2
     
-    if fetch then
+    if fetch and not resuming then
       local min_count = 100
       log:debug("bootstrap: connecting to peers...")
       while Peer.get_active_count() < min_count do
@@ -177,16 +194,77 @@ function Nanonet.bootstrap()
       log:debug("bootstrap: fetching frontiers... this should take a few minutes...")
       Nanonet.fetch_frontiers(3)
       t2=gettime()
-      log:debug("bootstrap: frontiers fetched in %s. finding already synced frontiers...", tdiff(t1, t2))
-      local already_synced = Frontier.delete_synced_frontiers()
-      log:debug("bootstrap: finished in %s. need to sync %i frontiers (%i already synced)", tdiff(t2, gettime()), Frontier.get_size(), already_synced)
+      log:debug("bootstrap: frontiers fetched in %s. merging pulls...", tdiff(t1, t2))
+      local merged, conflicts = Frontier.merge_pulls()
+      log:debug("bootstrap: merged in %s. %i accounts already synced, need to sync %i frontiers, %i with conflicting pulls", tdiff(t2, gettime()), Frontier.count_synced(), merged, conflicts)
+      set_checkpoint("pulling")
+    end
+    
+    local function walk_start()
+      if DB.kv.get("bootstrap:walking") then
+        --the ledger's confirmation heights are the walk's progress. pick up from the accounts it hadn't caught up
+        local start = Account.find_behind()
+        log:debug("bootstrap: resuming the walk from %i accounts", #start)
+        return #start > 0 and start or "genesis"
+      end
+      DB.kv.set("bootstrap:walking", "1")
+      if from_snapshot then
+        --the snapshot's ledger stays valid. only the accounts that got new blocks need walking
+        local start = {}
+        local offset = 0
+        local batch
+        repeat
+          batch = Frontier.get_range(50000, offset)
+          DB.transaction(function()
+            for _, frontier in ipairs(batch) do
+              local acct, is_new = Account.get(frontier.account)
+              --persisted, so a walk resumed after a restart finds them with find_behind
+              acct.behind = true
+              if is_new then
+                acct:create_later()
+              end
+              acct:save_later("behind")
+              acct:save()
+              table.insert(start, acct)
+            end
+          end)
+          offset = offset + #batch
+        until #batch == 0
+        return #start > 0 and start or "genesis"
+      else
+        Account.clear()
+        Block.clear_ledger_validation()
+        return "genesis"
+      end
+    end
+    
+    local function verify_progress(walker)
+      --log:debug("bootstrap: ts: %i, verifying; %i \"already valid\", %i verified, %i failed, %i retries. actual ledger-valid: %i, queue: %s",
+      --os.time(), walker.stats.already_verified, walker.stats.verified, walker.stats.failed, walker.stats.retry, Account.count_confirmed_blocks(), tostring(walker.unvisited:count()))
+      print(("%i, %i, %i, %i, %i, %i"):format(os.time(), walker.stats.verified, Account.count_confirmed_blocks(), walker.stats.failed, walker.stats.retry, walker.unvisited:count()))
+    end
+    
+    if pipelined then
+      t1 = gettime()
+      log:debug("bootstrap: gathering, importing and verifying blocks...")
+      local walker = Nanonet.bootstrap_pipeline {
+        start = walk_start,
+        import_interrupt = coroutine.timeslice(),
+        verify_interrupt = coroutine.timeslice(),
+        verify_progress = verify_progress
+      }
+      log:debug("bootstrap: gathered, imported and verified blocks in %s. %i verified, %i failed, %i retries, %i waits on gaps. actual ledger-valid: %s",
+        tdiff(t1, gettime()), walker.stats.verified, walker.stats.failed, walker.stats.retry, walker.stats.gap_wait, Account.count_confirmed_blocks())
+      set_checkpoint("done")
+    elseif fetch and not past("pulling") then
       t1 = gettime()
       log:debug("bootstrap: gathering blocks... this should take 20-50 minutes...")
       Nanonet.bulk_pull_accounts()
       print("bootstrap: finished gathering blocks in %s", tdiff(t1, gettime()))
+      set_checkpoint("importing")
     end
     
-    if import then
+    if import and not pipelined and not past("importing") then
       local need_to_import = Block.count_bootstrapped()
       log:debug("bootstrap: importing %i blocks... this should take a few minutes...", need_to_import)
       local ti0 = gettime()
@@ -196,168 +274,438 @@ function Nanonet.bootstrap()
         log:debug("bootstrap: t: %.3f imported %i of %i blocks [%3.2f%%], (%.0fblocks/sec)", last_timestamp or 0, imported, need_to_import, (imported/need_to_import)*100, last_imported/t_diff)
       end)
       
-      Block.import_unverified_bootstrap_blocks(maybe_interrupt(1000), function(n, t, timestamp)
+      local _, import_from = Block.import_unverified_bootstrap_blocks(coroutine.timeslice(), function(n, t, timestamp)
         --progress handler
         imported = (imported or 0) + n
         last_imported = n
         t_diff = t
         last_timestamp = timestamp
-      end)
+      end, {from = tonumber(DB.kv.get("bootstrap:import_from"))})
       Timer.cancel(watcher)
+      DB.kv.set("bootstrap:import_from", tostring(import_from))
+      if fetch then
+        set_checkpoint("verifying")
+      end
       log:debug("bootstrap: imported %i blocks in %s", need_to_import, tdiff(ti0, gettime()))
       
       --Block.clear_bootstrap()
     end
     
-    if verify then
-      
+    if verify and not pipelined then
       local walker = BlockWalker.new {
-        start = "genesis",
+        start = walk_start(),
         direction = "frontier",
-        interrupt = maybe_interrupt(20)
+        interrupt = coroutine.timeslice()
       }
       
       local watcher = Timer.interval(1000, function()
-        --log:debug("bootstrap: ts: %i, verifying; %i \"already valid\", %i verified, %i failed, %i retries. actual ledger-valid: %i, queue: %s",
-        --os.time(), walker.stats.already_verified, walker.stats.verified, walker.stats.failed, walker.stats.retry, Block.count_valid("ledger"), tostring(walker.unvisited:count()))
-        print(("%i, %i, %i, %i, %i, %i"):format(os.time(), walker.stats.verified, Block.count_valid("ledger"), walker.stats.failed, walker.stats.retry, walker.unvisited:count()))
+        verify_progress(walker)
       end)
       
-      
-      DB.db():exec("delete from accounts")
-      DB.db():exec("update blocks set valid = 2 where valid > 2")
-      
       assert(walker:walk())
       
       Timer.cancel(watcher)
       log:debug("bootstrap: verifying finished. %i already valid, %i verified, %i failed, %i retries. actual ledger-valid: %s",
-        walker.stats.already_verified, walker.stats.verified, walker.stats.failed, walker.stats.retry, Block.count_valid("ledger"))
+        walker.stats.already_verified, walker.stats.verified, walker.stats.failed, walker.stats.retry, Account.count_confirmed_blocks())
+      if fetch then
+        set_checkpoint("done")
+      end
       
     end
     
     local t3 = os.time()
     log:debug("Bootstrap took %s", tdiff(t0, t3))
     
+    if config.bootstrap.export_snapshot then
+      local nblocks, naccounts = Snapshot.write(config.bootstrap.export_snapshot)
+      if not nblocks then
+        log:warn("bootstrap: can't write ledger snapshot: %s", naccounts)
+      end
+    end
+    
   end)
   return coroutine.resume(coro)
 end
 
-function Nanonet.bulk_pull_accounts()
+--opt.start(): the walker's start, called once the walk can begin
+--opt.import_interrupt, opt.verify_interrupt: called between units of work, to yield to the event loop
+--opt.verify_progress(walker): called every second during the walk
+function Nanonet.bootstrap_pipeline(opt)
+  --three stages, each in its own coroutine, with bounded hand-offs between them:
+  -- pull:   accounts are bulk-pulled off the merged frontier into the staging table
+  -- import: staged blocks move to the blocks table as they land. their accounts are fed to the walker
+  -- verify: the walk starts as soon as the genesis block is in, and parks accounts on gaps until
+  --         the import catches up instead of pulling the missing blocks itself
+  local max_staged = 500000 --pulled blocks not yet imported. past this, pulls wait for the import
+  local staged, pulling, importing = Block.count_bootstrapped(), true, true --whatever was staged before a restart
+  local genesis_in, walker = false, nil
+  
+  local importable = coroutine.condition("pipeline import", function()
+    return staged > 0 or not pulling
+  end)
+  local pullable = coroutine.condition("pipeline pull", function()
+    return staged < max_staged
+  end)
+  local walkable = coroutine.condition("pipeline verify", function()
+    return genesis_in or not importing
+  end)
+  
+  coroutine.wrap(function()
+    Nanonet.bulk_pull_accounts(function(n)
+      staged = staged + n
+      importable:check()
+    end, pullable)
+    pulling = false
+    importable:check()
+  end)()
+  
+  coroutine.wrap(function()
+    --staged blocks survive a restart, and so does how far into them the import got
+    local from, imported = tonumber(DB.kv.get("bootstrap:import_from")), 0
+    local touched = function(accts)
+      if walker then
+        --some of these were already walked and came up empty. they'll have more to go now
+        --the ones it hasn't come across yet, it'll reach by their sends
+        local batch, acct = {}, nil
+        for _, acct_id in ipairs(accts) do
+          acct = Account.find(acct_id)
+          if acct then
+            table.insert(batch, acct)
+          end
+        end
+        walker:feed(batch)
+      end
+    end
+    while pulling or staged > 0 do
+      importable:wait()
+      local n = staged
+      local _
+      _, from = Block.import_unverified_bootstrap_blocks(opt.import_interrupt, function(n_imported)
+        imported = imported + n_imported
+      end, {from = from, reindex = false, touched = touched})
+      DB.kv.set("bootstrap:import_from", tostring(from))
+      staged = staged - n
+      pullable:check()
+      if not genesis_in and Block.find(Block.genesis.hash) then
+        genesis_in = true
+        walkable:check()
+      end
+    end
+    log:debug("bootstrap pipeline: imported %i blocks", imported)
+    importing = false
+    walkable:check()
+    if walker then
+      walker:feed()
+    end
+  end)()
+  
+  walkable:wait()
+  walker = BlockWalker.new {
+    start = opt.start(),
+    direction = "frontier",
+    interrupt = opt.verify_interrupt,
+    more_coming = function()
+      return importing
+    end
+  }
+  local watcher = opt.verify_progress and Timer.interval(1000, function()
+    opt.verify_progress(walker)
+  end)
+  assert(walker:walk())
+  if watcher then
+    Timer.cancel(watcher)
+  end
+  return walker
+end
+
+--on_staged(n): called after each batch of pulled blocks is staged
+--pullable:       optional condition. while it's not ready, workers finish what they've requested and wait on it
+function Nanonet.bulk_pull_accounts(on_staged, pullable)
   --print("now bulk_pull some accounts", #frontier)
+  local gettime = require "prailude.util.lowlevel".gettime
   local min_speed = 3 --blocks/sec
   local active_peers = {}
-  local frontier_size = Frontier.get_size()
+  --accounts already pulled by an interrupted bootstrap aren't pulled again
+  local frontier_size = Frontier.get_size() - Frontier.count_pulled()
   local total_blocks_fetched, total_accounts_fetched, total_accounts_failed = 0, 0, 0
   
-  local account_frontier_score_delta = 1/frontier_size
+  local account_frontier_score_delta = 1/math.max(frontier_size, 1)
   
-  local source = Util.BatchSource(function(n)
-    local batch = Frontier.get_range(50000, n)
+  local last_account
+  local source = Util.BatchSource(function()
+    local batch = Frontier.get_unpulled_range(50000, last_account)
     if #batch > 0 then
+      last_account = batch[#batch].account
       return batch
     else
       return nil
     end
   end)
   
+  --a pulled account's marker goes into the sink after its blocks, so it's only
+  -- checkpointed as pulled once they're all staged
   local sink = Util.BatchSink {
     batch_size = 10000,
     consume = function(batch)
-      Block.batch_store_bootstrap(batch)
+      local blocks, pulled = {}, {}
+      for _, item in ipairs(batch) do
+        if Block.is_instance(item) then
+          table.insert(blocks, item)
+        else
+          table.insert(pulled, item.pulled)
+        end
+      end
+      Block.batch_store_bootstrap(blocks)
+      if #pulled > 0 then
+        Frontier.mark_pulled(pulled)
+      end
+      if on_staged then
+        on_staged(#blocks)
+      end
     end
   }
   
-  local function bulk_pull_worker(acct_frontier)
-    local peer = assert(Peer.get_best_bootstrap_peer())
-    active_peers[peer] = {frontier = acct_frontier, blocks_pulled = 0}
-    local prev_blocks, slow_in_a_row = 0, 0
-    local acct_blocks_count, frontier_hash_found_or_err = Account.bulk_pull(acct_frontier, peer, {
-      consume = function(batch)
-        --blocks should have already been PoW and sig checked
-        for _, block in ipairs(batch) do
-          sink:add(block)
-        end
-        return #batch
+  --how many peers to pull from at once. finds its own level between a handful and config.bootstrap.max_peers
+  local concurrency = coroutine.aimd {
+    min = 4,
+    max = config.bootstrap.max_peers,
+    initial = math.min(8, config.bootstrap.max_peers)
+  }
+  
+  --chain length estimates, for sizing the per-peer queues: running means of blocks per pulled
+  -- account, kept apart for accounts we've never seen and ones we're only catching up
+  local chain_estimate = {new = {n = 0, sum = 0}, known = {n = 0, sum = 0}}
+  local function estimate(acct_frontier)
+    if acct_frontier.known == nil then
+      acct_frontier.known = Account.find(acct_frontier.account) and true or false
+    end
+    return chain_estimate[acct_frontier.known and "known" or "new"]
+  end
+  
+  local schedule
+  local function new_schedule(work_source)
+    return Util.WorkScheduler {
+      source = work_source,
+      key = function(acct_frontier)
+        return acct_frontier.account
       end,
-      watchdog = function(blocks_so_far_count)
-        --print(tostring(peer), blocks_so_far_count, prev_blocks)
-        local blocks_fetched = blocks_so_far_count - prev_blocks
-        prev_blocks = blocks_so_far_count
-        if blocks_fetched < min_speed then -- too slow
-          if slow_in_a_row > 2 then
-            return false, "account pull too slow"
-          else
-            slow_in_a_row = slow_in_a_row + 1
-          end
-        else
-          active_peers[peer].blocks_pulled = blocks_so_far_count
+      cost = function(acct_frontier)
+        local est = estimate(acct_frontier)
+        return est.n > 0 and math.max(est.sum / est.n, 1) or 1
+      end,
+      retry = 2,
+      tail = 4
+    }
+  end
+  
+  local function pull_failed(peer, err)
+    concurrency:failure()
+    if err:match("^bad signature") or err:match("^bad PoW") or err:match("^bad block") then
+      peer:update_bootstrap_score(- 100 * account_frontier_score_delta)
+    elseif err == "account pull too slow" then
+      peer:update_bootstrap_score(- 10 * account_frontier_score_delta)
+    elseif err == "Connection refused" or err == "No route to host" then
+      peer:update_bootstrap_score(-1)
+    else
+      peer:update_bootstrap_score(-account_frontier_score_delta)
+    end
+  end
+  
+  --each worker sticks to one peer and works through that peer's queue of accounts, over the
+  -- one connection that's kept open between pulls. so a peer belongs to one worker at a time
+  local busy_peers = {}
+  local function pick_peer(except)
+    if except then
+      busy_peers[except] = nil
+    end
+    local peers = Peer.get_best_bootstrap_peer{limit = concurrency.limit + 1}
+    for _, peer in ipairs(peers) do
+      if not busy_peers[peer] and peer ~= except then
+        busy_peers[peer] = true
+        return peer
+      end
+    end
+  end
+  
+  local working = 0
+  local function bulk_pull_worker(worker)
+    working = working + 1
+    worker.working = true
+    local peer
+    local accounts_pulled = 0
+    --when the concurrency limit drops, workers beyond it leave after what they've already requested
+    while working <= concurrency.limit do
+      if pullable then
+        --held back outside the pull session, so its watchdog doesn't take the wait for a slow peer
+        pullable:wait()
+      end
+      peer = peer or pick_peer()
+      worker.peer = peer
+      local pulling, pulling_count = {}, 0
+      local function next_account()
+        if working > concurrency.limit or (pullable and not pullable:ready()) then
+          return nil
+        end
+        local acct_frontier, duplicate = schedule:next(worker)
+        if acct_frontier ~= nil then
+          --a duplicate holds on to its blocks until it knows it finished first
+          pulling[acct_frontier] = {held = duplicate and {} or nil}
+          pulling_count = pulling_count + 1
         end
+        return acct_frontier
       end
-    })
-    
-    --print("bulk   pull... done")
-    active_peers[peer]=nil
-    
-    if acct_blocks_count then
-      if frontier_hash_found_or_err then
-        --everything's okay
-        total_blocks_fetched = total_blocks_fetched + acct_blocks_count
-        peer:update_bootstrap_score(account_frontier_score_delta)
-        return acct_blocks_count
+      
+      local requested, err
+      if not peer then
+        --every peer worth pulling from is taken. back off until one frees up, rather than fail accounts for want of one
+        if not schedule:has_work() and schedule:active() == 0 then
+          break
+        end
+        Timer.delay(1000)
       else
-        --assume it's the peer's fault we didn't find the frontier hash
-        -- ATTACK VECTOR: this assumes we trust the frontier, which means an attacker
-        -- that poisons the frontier will eventually gain bootstrap-score over legit peers
-        total_blocks_fetched = total_blocks_fetched + acct_blocks_count
-        peer:update_bootstrap_score(-100 * account_frontier_score_delta)
-        print("peer", tostring(peer), "account found, but without frontier. that's okay though, we'll take it")
-        --return nil, "account found, but without frontier"
-        return acct_blocks_count
+        local prev_blocks, slow_in_a_row = 0, 0
+        local last_finished = gettime()
+        active_peers[peer] = {blocks_pulled = 0}
+        requested, err = Account.bulk_pull_pipelined(peer, {
+          window = config.bootstrap.bulk_pull_window,
+          next = next_account,
+          consume = function(batch, acct_frontier)
+            local pull = pulling[acct_frontier]
+            --blocks should have already been PoW and sig checked.
+            -- if someone else already pulled this account, let them go by
+            if not schedule:finished(acct_frontier) then
+              for _, block in ipairs(batch) do
+                if pull.held then
+                  table.insert(pull.held, block)
+                else
+                  sink:add(block)
+                end
+              end
+            end
+            concurrency:success(#batch)
+            return #batch
+          end,
+          finished = function(acct_frontier, acct_blocks_count, frontier_hash_found)
+            local pull = pulling[acct_frontier]
+            pulling[acct_frontier] = nil
+            pulling_count = pulling_count - 1
+            if frontier_hash_found then
+              peer:update_bootstrap_score(account_frontier_score_delta)
+            else
+              --assume it's the peer's fault we didn't find the frontier hash
+              -- ATTACK VECTOR: this assumes we trust the frontier, which means an attacker
+              -- that poisons the frontier will eventually gain bootstrap-score over legit peers
+              peer:update_bootstrap_score(-100 * account_frontier_score_delta)
+              print("peer", tostring(peer), "account found, but without frontier. that's okay though, we'll take it")
+            end
+            --responses overlap, so the peer's rate is measured from one finished account to the next
+            local now = gettime()
+            if schedule:done(worker, acct_frontier, acct_blocks_count, now - last_finished) then
+              for _, block in ipairs(pull.held or {}) do
+                sink:add(block)
+              end
+              if frontier_hash_found then
+                sink:add({pulled = {account = acct_frontier.account, frontier = acct_frontier.frontier}})
+              end
+              local est = estimate(acct_frontier)
+              est.n, est.sum = est.n + 1, est.sum + acct_blocks_count
+              total_blocks_fetched = total_blocks_fetched + acct_blocks_count
+              accounts_pulled = accounts_pulled + 1
+            end
+            last_finished = now
+          end,
+          watchdog = function(blocks_so_far_count)
+            --print(tostring(peer), blocks_so_far_count, prev_blocks)
+            local blocks_fetched = blocks_so_far_count - prev_blocks
+            prev_blocks = blocks_so_far_count
+            if blocks_fetched < min_speed then -- too slow
+              if slow_in_a_row > 2 then
+                return false, "account pull too slow"
+              else
+                slow_in_a_row = slow_in_a_row + 1
+              end
+            else
+              active_peers[peer].blocks_pulled = blocks_so_far_count
+            end
+          end
+        })
+        --print("bulk   pull... done")
+        active_peers[peer] = nil
       end
-    else -- there was an error
-      local err = frontier_hash_found_or_err
-      log:debug("bootstrap:  acct pull %s from peer %s error %s", Account.to_readable(acct_frontier.account), tostring(peer), err)
-      if err:match("^bad signature") or err:match("^bad PoW") or err:match("^bad block") then
-        peer:update_bootstrap_score(- 100 * account_frontier_score_delta)
-      elseif err == "account pull too slow" then
-        peer:update_bootstrap_score(- 10 * account_frontier_score_delta)
-      elseif err == "Connection refused" or err == "No route to host" then
-        peer:update_bootstrap_score(-1)
-      else
-        peer:update_bootstrap_score(-account_frontier_score_delta)
+      
+      if peer and (not requested or pulling_count > 0) then
+        --whatever was still outstanding wasn't pulled
+        err = err or "unspecified error"
+        for acct_frontier in pairs(pulling) do
+          schedule:failed(worker, acct_frontier, err)
+        end
+        log:debug("bootstrap:  pull of %i accounts from peer %s error %s", pulling_count, tostring(peer), err)
+        pull_failed(peer, err)
+        --try someone else
+        peer = pick_peer(peer)
+      elseif requested == 0 and (not pullable or pullable:ready()) then
+        --nothing to pull right now
+        if schedule:active() == 0 then
+          break
+        end
+        --the tail's still running elsewhere, and might fail back into the queue
+        Timer.delay(500)
       end
-      return nil, err
     end
+    return accounts_pulled
+  end
+  
+  --after a worker's done, or errored out
+  local function bulk_pull_worker_left(worker, err)
+    if worker.peer then
+      busy_peers[worker.peer] = nil
+    end
+    if worker.working then
+      working = working - 1
+    end
+    --whatever it had queued goes back to the others
+    schedule:leave(worker, err)
   end
   
   local current_frontier_size = frontier_size
   
-  local function bulk_pull_progress(active_workers, work_done, _, work_failed)
+  local function bulk_pull_progress(active_workers)
     local bus_data = {
       complete = false,
       active_peers = active_peers,
       frontier_size = frontier_size,
-      accounts_fetched = #work_done,
-      accounts_failed = #work_failed
+      accounts_fetched = schedule.completed,
+      accounts_failed = #schedule.failures
     }
-    log:debug("bulk pull: using %i workers, finished %i of %i accounts [%3.2f%%] (%i blocks) (%i failed attempts)", active_workers, #work_done, current_frontier_size, 100 * #work_done / current_frontier_size, total_blocks_fetched, #work_failed)
+    log:debug("bulk pull: using %i of %i allowed peers (%.0f blocks/sec), finished %i of %i accounts [%3.2f%%] (%i blocks) (%i failed, %i steals, %i duplicates)", active_workers, concurrency.limit, concurrency.rate or 0, schedule.completed, current_frontier_size, 100 * schedule.completed / current_frontier_size, total_blocks_fetched, #schedule.failures, schedule.stolen, schedule.duplicated)
     
     Bus.pub("bulk_pull:progress", bus_data)
   end
-  local ok, failed, errs
+  local failed, errs
   for i=1, 5 do
-    ok, failed, errs = coroutine.workpool({
+    schedule = new_schedule(source)
+    local hired = 0
+    coroutine.workpool({
+      --a job here is a worker for the schedule, hired while there's work nobody's queued up yet
       work = function()
-        return source:next()
+        if schedule:has_work() then
+          hired = hired + 1
+          return {id = hired}
+        end
       end,
-      max_workers = config.bootstrap.max_peers,
-      retry = 2,
+      max_workers = concurrency.max_workers,
+      wake = concurrency.wake,
       progress = bulk_pull_progress,
-      worker = bulk_pull_worker
+      worker = bulk_pull_worker,
+      check = function(worker, _, err)
+        return bulk_pull_worker_left(worker, err)
+      end
     })
     sink:finish()
-    total_accounts_fetched = total_accounts_fetched + #ok
-    log:debug("bulk_pull attempt %i: %i pulled, %i failed", i, #ok, #failed)
+    failed, errs = schedule.failures, schedule.failure_reasons
+    total_accounts_fetched = total_accounts_fetched + schedule.completed
+    total_accounts_failed = #failed
+    log:debug("bulk_pull attempt %i: %i pulled, %i failed", i, schedule.completed, #failed)
     
     if #failed == 0 then
       break
@@ -374,6 +722,8 @@ function Nanonet.bulk_pull_accounts()
     end
   end
   
+  concurrency.stop()
+  
   local bus_data = {
     complete = true,
     frontier_size = frontier_size,
@@ -16,6 +16,7 @@ local Prailude = {
 
 Prailude.initialize =   Prailude.control.initialize
 Prailude.run =          Prailude.control.run
+Prailude.write_snapshot = Prailude.control.write_snapshot
 --[[
 _G.DBG = function(...)
   local mm = require "mm"
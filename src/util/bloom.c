@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "bloom.h"
+
+// bloom filter over hashes, for answering "definitely don't have it" without a db read.
+// keys are expected to be hashes already (block hashes are blake2b), so the k probe positions
+// come straight from the key's bytes by double hashing instead of hashing it all over again.
+// saved in native byte order, it's a local cache.
+
+#define BLOOM_FILE_MAGIC    "PRLDBLOM"
+#define BLOOM_FILE_VERSION  1
+#define BLOOM_LN2           0.69314718055994530942
+
+typedef struct {
+  uint8_t   *bits;
+  uint64_t   nbits;
+  uint64_t   capacity;  //items it was sized for
+  uint64_t   count;     //items added (approximately: re-adding a present key isn't counted)
+  uint32_t   k;
+} bloom_t;
+
+static void setfield_cfunction(lua_State *L, int tindex, const char *fname, lua_CFunction func) {
+  lua_pushcfunction(L, func);
+  if(tindex < 0) {
+    tindex--;
+  }
+  lua_setfield(L, tindex, fname);
+}
+
+static bloom_t *bloom_check(lua_State *L, int index) {
+  bloom_t *bf = luaL_checkudata(L, index, "prailude.bloom");
+  if(bf->bits == NULL) {
+    luaL_error(L, "bloom filter has been freed");
+  }
+  return bf;
+}
+
+static void bloom_key(const char *key, size_t len, uint64_t *h1, uint64_t *h2) {
+  if(len >= 16) {
+    memcpy(h1, key, 8);
+    memcpy(h2, key + 8, 8);
+  }
+  else { //short keys aren't hashes, so make them into one. FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    size_t   i;
+    for(i = 0; i < len; i++) {
+      h = (h ^ (uint8_t )key[i]) * 1099511628211ULL;
+    }
+    *h1 = h;
+    *h2 = (h >> 33 | h << 31) * 0xff51afd7ed558ccdULL;
+  }
+  *h2 |= 1; //odd, so the probes never collapse onto one bit
+}
+
+static bool bloom_alloc(bloom_t *bf, uint64_t capacity, double fp_rate) {
+  double   nbits;
+  uint32_t k;
+  if(capacity < 1024) {
+    capacity = 1024;
+  }
+  nbits = ceil(-(double )capacity * log(fp_rate) / (BLOOM_LN2 * BLOOM_LN2));
+  k = (uint32_t )round(nbits / capacity * BLOOM_LN2);
+  if(k < 1) k = 1;
+  if(k > 16) k = 16;
+  bf->nbits = ((uint64_t )nbits + 63) & ~(uint64_t )63;
+  bf->capacity = capacity;
+  bf->count = 0;
+  bf->k = k;
+  bf->bits = calloc(bf->nbits / 8, 1);
+  return bf->bits != NULL;
+}
+
+static bloom_t *bloom_push(lua_State *L) {
+  bloom_t *bf = lua_newuserdata(L, sizeof(*bf));
+  memset(bf, 0, sizeof(*bf));
+  luaL_getmetatable(L, "prailude.bloom");
+  lua_setmetatable(L, -2);
+  return bf;
+}
+
+// Bloom.new(capacity, fp_rate)
+static int lua_bloom_new(lua_State *L) {
+  lua_Number  capacity = luaL_checknumber(L, 1);
+  double      fp_rate = luaL_optnumber(L, 2, 0.01);
+  bloom_t    *bf;
+
+  luaL_argcheck(L, capacity >= 0, 1, "capacity can't be negative");
+  luaL_argcheck(L, fp_rate > 0 && fp_rate < 1, 2, "false-positive rate must be between 0 and 1");
+  bf = bloom_push(L);
+  if(!bloom_alloc(bf, capacity, fp_rate)) {
+    return luaL_error(L, "Out of memory, can't allocate bloom filter");
+  }
+  return 1;
+}
+
+// bf:add(key) -- true if the key was definitely not there before
+static int lua_bloom_add(lua_State *L) {
+  bloom_t    *bf = bloom_check(L, 1);
+  size_t      len;
+  const char *key = luaL_checklstring(L, 2, &len);
+  uint64_t    h1, h2, bit;
+  uint32_t    i;
+  bool        added = false;
+
+  bloom_key(key, len, &h1, &h2);
+  for(i = 0; i < bf->k; i++) {
+    bit = (h1 + i * h2) % bf->nbits;
+    if(!(bf->bits[bit >> 3] & (1 << (bit & 7)))) {
+      bf->bits[bit >> 3] |= 1 << (bit & 7);
+      added = true;
+    }
+  }
+  if(added) {
+    bf->count++;
+  }
+  lua_pushboolean(L, added);
+  return 1;
+}
+
+// bf:test(key) -- false if the key was never added, true if it maybe was
+static int lua_bloom_test(lua_State *L) {
+  bloom_t    *bf = bloom_check(L, 1);
+  size_t      len;
+  const char *key = luaL_checklstring(L, 2, &len);
+  uint64_t    h1, h2, bit;
+  uint32_t    i;
+
+  bloom_key(key, len, &h1, &h2);
+  for(i = 0; i < bf->k; i++) {
+    bit = (h1 + i * h2) % bf->nbits;
+    if(!(bf->bits[bit >> 3] & (1 << (bit & 7)))) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int lua_bloom_count(lua_State *L) {
+  bloom_t *bf = bloom_check(L, 1);
+  lua_pushnumber(L, bf->count);
+  return 1;
+}
+
+static int lua_bloom_capacity(lua_State *L) {
+  bloom_t *bf = bloom_check(L, 1);
+  lua_pushnumber(L, bf->capacity);
+  return 1;
+}
+
+static int lua_bloom_clear(lua_State *L) {
+  bloom_t *bf = bloom_check(L, 1);
+  memset(bf->bits, 0, bf->nbits / 8);
+  bf->count = 0;
+  return 0;
+}
+
+// bf:save(path[, tag]) -- tag is any number the caller wants back from Bloom.load, to tell if the file's stale.
+// written to path.tmp and moved into place
+static int lua_bloom_save(lua_State *L) {
+  bloom_t    *bf = bloom_check(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  double      tag = luaL_optnumber(L, 3, 0);
+  uint32_t    version = BLOOM_FILE_VERSION;
+  char        tmppath[1024];
+  FILE       *f;
+  bool        ok;
+
+  if(snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int )sizeof(tmppath)) {
+    return luaL_error(L, "bloom filter path too long");
+  }
+  if((f = fopen(tmppath, "wb")) == NULL) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "can't open %s for writing", tmppath);
+    return 2;
+  }
+  ok = fwrite(BLOOM_FILE_MAGIC, 8, 1, f) == 1
+    && fwrite(&version, sizeof(version), 1, f) == 1
+    && fwrite(&bf->k, sizeof(bf->k), 1, f) == 1
+    && fwrite(&bf->nbits, sizeof(bf->nbits), 1, f) == 1
+    && fwrite(&bf->capacity, sizeof(bf->capacity), 1, f) == 1
+    && fwrite(&bf->count, sizeof(bf->count), 1, f) == 1
+    && fwrite(&tag, sizeof(tag), 1, f) == 1
+    && fwrite(bf->bits, bf->nbits / 8, 1, f) == 1;
+  if(fclose(f) != 0 || !ok || rename(tmppath, path) != 0) {
+    remove(tmppath);
+    lua_pushnil(L);
+    lua_pushfstring(L, "failed to write bloom filter %s", path);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// Bloom.load(path) -- bloom filter, tag. nil, err if it's not there or is broken
+static int lua_bloom_load(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  char        magic[8];
+  uint32_t    version;
+  double      tag;
+  FILE       *f;
+  bloom_t    *bf;
+  const char *err = NULL;
+
+  if((f = fopen(path, "rb")) == NULL) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "no bloom filter at %s", path);
+    return 2;
+  }
+  bf = bloom_push(L);
+  if(fread(magic, 8, 1, f) != 1 || memcmp(magic, BLOOM_FILE_MAGIC, 8) != 0
+   || fread(&version, sizeof(version), 1, f) != 1 || version != BLOOM_FILE_VERSION
+   || fread(&bf->k, sizeof(bf->k), 1, f) != 1
+   || fread(&bf->nbits, sizeof(bf->nbits), 1, f) != 1
+   || fread(&bf->capacity, sizeof(bf->capacity), 1, f) != 1
+   || fread(&bf->count, sizeof(bf->count), 1, f) != 1
+   || fread(&tag, sizeof(tag), 1, f) != 1
+   || bf->k < 1 || bf->k > 16 || bf->nbits == 0 || bf->nbits % 64 != 0) {
+    err = "bad bloom filter header";
+  }
+  else if((bf->bits = malloc(bf->nbits / 8)) == NULL) {
+    err = "Out of memory, can't allocate bloom filter";
+  }
+  else if(fread(bf->bits, bf->nbits / 8, 1, f) != 1) {
+    err = "truncated bloom filter";
+  }
+  fclose(f);
+  if(err) {
+    free(bf->bits);
+    bf->bits = NULL;
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+  }
+  lua_pushnumber(L, tag);
+  return 2;
+}
+
+static int lua_bloom_gc(lua_State *L) {
+  bloom_t *bf = luaL_checkudata(L, 1, "prailude.bloom");
+  free(bf->bits);
+  bf->bits = NULL;
+  return 0;
+}
+
+static const struct luaL_Reg prailude_bloom_functions[] = {
+  { "new", lua_bloom_new },
+  { "load", lua_bloom_load },
+
+  { NULL, NULL }
+};
+
+int luaopen_prailude_util_bloom(lua_State* L) {
+  luaL_newmetatable(L, "prailude.bloom");
+
+  //__index
+  lua_createtable(L, 0, 6);
+  setfield_cfunction(L, -1, "add",      lua_bloom_add);
+  setfield_cfunction(L, -1, "test",     lua_bloom_test);
+  setfield_cfunction(L, -1, "count",    lua_bloom_count);
+  setfield_cfunction(L, -1, "capacity", lua_bloom_capacity);
+  setfield_cfunction(L, -1, "clear",    lua_bloom_clear);
+  setfield_cfunction(L, -1, "save",     lua_bloom_save);
+  lua_setfield(L, -2, "__index");
+
+  setfield_cfunction(L, -1, "__gc", lua_bloom_gc);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+#if LUA_VERSION_NUM > 501
+  luaL_setfuncs(L,prailude_bloom_functions,0);
+#else
+  luaL_register(L, NULL, prailude_bloom_functions);
+#endif
+  return 1;
+}
@@ -73,6 +73,9 @@ local Condition = function(name, check)
       end
       return 0
     end,
+    ready = function()
+      return check() and true or false
+    end,
   }, {__tostring = function()
     return ("condition %s [%s] (waiting: %i)"):format(name, check() and "true" or "false", #waiting)
   end})
@@ -132,6 +135,10 @@ local Workpool = function(opt)
   local check = nil
   if opt.check then check = opt.check end
   
+  --opt.wake(recheck), if given, gets a function to call whenever max_workers might allow more workers
+  -- than before. otherwise that's only rechecked when a worker leaves
+  local wake = opt.wake
+  
   local active_workers = 0
   
   local moreworkers
@@ -228,6 +235,12 @@ local Workpool = function(opt)
     foreman:check()
   end
   
+  if wake then
+    wake(function()
+      shiftmanager:check()
+    end)
+  end
+  
   local company = coroutine.wrap(function()
     for job in nextjob() do
       --print("run the worker ", workwrap ,"for job " ..current_job)
@@ -248,10 +261,140 @@ local Workpool = function(opt)
   if inspector then
     inspector:stop()
   end
+  if wake then
+    wake(nil)
+  end
   return work.done, work.fail, work.fail_reason
 end
 
+--concurrency limit for a workpool's max_workers that finds its own level: additive increase while
+-- the measured throughput keeps climbing, a step back when it plateaus, multiplicative decrease
+-- when it drops or the error rate spikes.
+-- workers report progress with limiter:success(units_of_work) and limiter:failure()
+local aimd_defaults = {__index = {
+  min = 1,
+  max = 100,
+  increase = 1,         --workers added per interval while throughput rises
+  decrease = 0.5,       --multiplier on a throughput drop or error spike
+  min_gain = 0.05,      --throughput must rise by this fraction to count as rising
+  max_error_ratio = 0.3,
+  interval = 5000       --ms between adjustments
+}}
+
+local AIMD = function(opt)
+  local Timer = require "prailude.util.timer"
+  opt = setmetatable(opt or {}, aimd_defaults)
+  local floor, min, max = math.floor, math.min, math.max
+  local done, failed = 0, 0
+  local last_rate, best_rate, best_limit = 0, 0, nil
+  
+  local limiter = {limit = opt.initial or opt.min}
+  local recheck
+  
+  function limiter.success(_, n)
+    done = done + (n or 1)
+  end
+  function limiter.failure(_, n)
+    failed = failed + (n or 1)
+  end
+  
+  --for workpool's max_workers
+  function limiter.max_workers(active_workers)
+    return active_workers < limiter.limit
+  end
+  --for workpool's wake. the pool gets rechecked when the limit goes up, so it can hire up to it
+  function limiter.wake(fn)
+    recheck = fn
+  end
+  
+  local function adjust()
+    local rate = done / (opt.interval / 1000)
+    local attempts = done + failed
+    local error_ratio = attempts > 0 and failed / attempts or 0
+    local limit = limiter.limit
+    if error_ratio > opt.max_error_ratio or rate < last_rate * (1 - opt.min_gain * 4) then
+      limit = floor(limit * opt.decrease)
+    elseif rate > last_rate * (1 + opt.min_gain) then
+      limit = limit + opt.increase
+    elseif best_limit and best_limit < limit then
+      --more workers, no more throughput. go back toward what worked best
+      limit = limit - opt.increase
+    end
+    if rate > best_rate then
+      best_rate, best_limit = rate, limiter.limit
+    end
+    limit = max(opt.min, min(opt.max, limit))
+    local raised = limit > limiter.limit
+    limiter.limit = limit
+    limiter.rate, limiter.error_ratio = rate, error_ratio
+    last_rate, done, failed = rate, 0, 0
+    if raised and recheck then
+      recheck()
+    end
+  end
+  
+  local timer = Timer.interval(opt.interval, adjust)
+  function limiter.stop()
+    if timer then
+      Timer.cancel(timer)
+      timer = nil
+    end
+  end
+  
+  return limiter
+end
+
+--cooperative time slicing for long-running work in a coroutine. returns a function to call between
+-- units of work: once the coroutine's been at it for `slice_ms` (5ms) by the monotonic clock, it yields
+-- to the event loop and gets resumed right after the next I/O poll. an active idle handle keeps that
+-- poll from blocking, so with no I/O pending the coroutine is back at it straight away.
+-- one idle and one check handle are shared by everything that's yielded a slice
+local Timeslice; do
+  local uv
+  local idle, check
+  local sliced = {}
+
+  local function resume_sliced()
+    uv.check_stop(check)
+    uv.idle_stop(idle)
+    local now_sliced = sliced
+    sliced = {}
+    for _, coro in ipairs(now_sliced) do
+      resume(coro)
+    end
+  end
+
+  local function noop() end
+
+  Timeslice = function(slice_ms)
+    if not uv then
+      uv = require "luv"
+      idle, check = uv.new_idle(), uv.new_check()
+    end
+    local hrtime = uv.hrtime
+    local slice = (slice_ms or 5) * 1e6 --ns
+    local deadline = hrtime() + slice
+    return function()
+      if hrtime() < deadline then
+        return false
+      end
+      local coro = running()
+      assert(coro, "time slice must be yielded from a coroutine")
+      if #sliced == 0 then
+        uv.idle_start(idle, noop)
+        uv.check_start(check, resume_sliced)
+      end
+      table.insert(sliced, coro)
+      coroutine.yield()
+      deadline = hrtime() + slice
+      return true
+    end
+  end
+end
+
 coroutine_util.workpool = Workpool
+coroutine_util.timeslice = Timeslice
+coroutine_util.aimd = AIMD
 coroutine_util.condition = Condition
 
 return coroutine_util
@@ -0,0 +1,788 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "ledgerstate.h"
+
+// in-memory account ledger state: an open-addressing (linear probing) hash table
+// keyed by the 32-byte account id, with fixed-size entries.
+// persisted as a snapshot file plus an append-only log of changed entries since that snapshot.
+// the log has a commit marker after each committed db transaction's entries. on replay, whatever
+// follows the last marker belonged to a transaction that never committed, and is dropped.
+// while the log's open, every change also keeps the entry's previous state in an undo list until
+// the next commit, so a rolled-back transaction's changes come out of memory too.
+// both are written in native byte order -- they're local caches, not an interchange format.
+
+#define LEDGER_USED            0x01
+#define LEDGER_BEHIND          0x02
+#define LEDGER_HAS_BALANCE     0x04
+
+#define LEDGER_MIN_CAPACITY    1024
+#define LEDGER_SNAPSHOT_MAGIC  "PRLDLDGR"
+#define LEDGER_SNAPSHOT_VERSION 1
+#define LEDGER_LOG_RECORD_TAG  'A'
+#define LEDGER_LOG_COMMIT_TAG  'C'
+
+typedef struct {
+  uint8_t    id[32];
+  uint8_t    frontier[32];    //all zeroes if there's no frontier
+  uint8_t    balance[16];     //big-endian raw, same as everywhere else
+  uint64_t   block_count;
+  double     weight;          //delegated balance, inexactness is ok here
+  uint32_t   rep;             //index into reps, 0 for none
+  uint32_t   flags;
+} ledger_entry_t;
+
+typedef struct {
+  uint8_t    id[32];
+} ledger_rep_t;
+
+typedef struct {
+  ledger_entry_t  *entries;
+  size_t           capacity;  //always a power of 2
+  size_t           count;
+
+  ledger_rep_t    *reps;      //reps[0] is unused, index 0 means no rep
+  size_t           reps_count;
+  size_t           reps_capacity;
+  uint32_t        *rep_slots; //open-addressing index of rep id -> index in reps
+  size_t           rep_slots_capacity;
+
+  FILE            *log;
+  long             log_committed;   //log offset just past the last commit marker
+  size_t           log_uncommitted; //entries logged since then
+  size_t           log_entries;     //entries in the log altogether
+
+  ledger_entry_t  *undo;            //entries as they were before each change since the last commit.
+  size_t           undo_count;      // flags == 0 for one that wasn't there
+  size_t           undo_capacity;
+} ledger_state_t;
+
+static const uint8_t zero_hash[32] = {0};
+
+static size_t id_hash(const uint8_t *id) {
+  //account ids are public keys, so any 8 bytes of them are as good as a hash
+  uint64_t h;
+  memcpy(&h, id, sizeof(h));
+  return (size_t )h;
+}
+
+static ledger_entry_t *entry_slot(ledger_entry_t *entries, size_t capacity, const uint8_t *id) {
+  size_t           mask = capacity - 1;
+  size_t           i = id_hash(id) & mask;
+  ledger_entry_t  *cur;
+  for(;;) {
+    cur = &entries[i];
+    if(!(cur->flags & LEDGER_USED) || memcmp(cur->id, id, 32) == 0) {
+      return cur;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+static bool entries_grow(ledger_state_t *ls) {
+  size_t           i, new_capacity = ls->capacity * 2;
+  ledger_entry_t  *new_entries, *cur;
+  if((new_entries = calloc(new_capacity, sizeof(*new_entries))) == NULL) {
+    return false;
+  }
+  for(i = 0; i < ls->capacity; i++) {
+    cur = &ls->entries[i];
+    if(cur->flags & LEDGER_USED) {
+      *entry_slot(new_entries, new_capacity, cur->id) = *cur;
+    }
+  }
+  free(ls->entries);
+  ls->entries = new_entries;
+  ls->capacity = new_capacity;
+  return true;
+}
+
+static ledger_entry_t *entry_find(ledger_state_t *ls, const uint8_t *id) {
+  ledger_entry_t *entry = entry_slot(ls->entries, ls->capacity, id);
+  return (entry->flags & LEDGER_USED) ? entry : NULL;
+}
+
+//backward-shift deletion, so no probe sequence is left with a hole in it
+static void entry_delete(ledger_state_t *ls, ledger_entry_t *entry) {
+  size_t  mask = ls->capacity - 1;
+  size_t  i = entry - ls->entries, j = i, k;
+  for(;;) {
+    j = (j + 1) & mask;
+    if(!(ls->entries[j].flags & LEDGER_USED)) {
+      break;
+    }
+    k = id_hash(ls->entries[j].id) & mask;
+    //entries whose home slot is cyclically in (i, j] are still reachable where they are
+    if(i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    ls->entries[i] = ls->entries[j];
+    i = j;
+  }
+  memset(&ls->entries[i], 0, sizeof(ls->entries[i]));
+  ls->count--;
+}
+
+static ledger_entry_t *entry_get_or_create(ledger_state_t *ls, const uint8_t *id) {
+  ledger_entry_t *entry;
+  if((ls->count + 1) * 10 > ls->capacity * 7 && !entries_grow(ls)) { //keep the load factor under 0.7
+    return NULL;
+  }
+  entry = entry_slot(ls->entries, ls->capacity, id);
+  if(!(entry->flags & LEDGER_USED)) {
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->id, id, 32);
+    entry->flags = LEDGER_USED;
+    ls->count++;
+  }
+  return entry;
+}
+
+static uint32_t *rep_slot(ledger_state_t *ls, uint32_t *slots, size_t capacity, const uint8_t *id) {
+  size_t     mask = capacity - 1;
+  size_t     i = id_hash(id) & mask;
+  for(;;) {
+    if(slots[i] == 0 || memcmp(ls->reps[slots[i]].id, id, 32) == 0) {
+      return &slots[i];
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+static bool rep_slots_grow(ledger_state_t *ls) {
+  size_t     i, new_capacity = ls->rep_slots_capacity * 2;
+  uint32_t  *new_slots;
+  if((new_slots = calloc(new_capacity, sizeof(*new_slots))) == NULL) {
+    return false;
+  }
+  for(i = 0; i < ls->rep_slots_capacity; i++) {
+    if(ls->rep_slots[i] != 0) {
+      *rep_slot(ls, new_slots, new_capacity, ls->reps[ls->rep_slots[i]].id) = ls->rep_slots[i];
+    }
+  }
+  free(ls->rep_slots);
+  ls->rep_slots = new_slots;
+  ls->rep_slots_capacity = new_capacity;
+  return true;
+}
+
+static uint32_t rep_index(ledger_state_t *ls, const uint8_t *id) {
+  uint32_t      *slot;
+  ledger_rep_t  *new_reps;
+
+  if((ls->reps_count + 1) * 10 > ls->rep_slots_capacity * 7 && !rep_slots_grow(ls)) {
+    return 0;
+  }
+  slot = rep_slot(ls, ls->rep_slots, ls->rep_slots_capacity, id);
+  if(*slot != 0) {
+    return *slot;
+  }
+  if(ls->reps_count + 1 >= ls->reps_capacity) {
+    if((new_reps = realloc(ls->reps, ls->reps_capacity * 2 * sizeof(*new_reps))) == NULL) {
+      return 0;
+    }
+    ls->reps = new_reps;
+    ls->reps_capacity *= 2;
+  }
+  ls->reps_count++;
+  memcpy(ls->reps[ls->reps_count].id, id, 32);
+  *slot = ls->reps_count;
+  return *slot;
+}
+
+static bool ledger_init(ledger_state_t *ls, size_t capacity) {
+  size_t cap = LEDGER_MIN_CAPACITY;
+  while(cap < capacity) {
+    cap *= 2;
+  }
+  memset(ls, 0, sizeof(*ls));
+  ls->capacity = cap;
+  ls->reps_capacity = 256;
+  ls->rep_slots_capacity = 512;
+  ls->entries = calloc(ls->capacity, sizeof(*ls->entries));
+  ls->reps = calloc(ls->reps_capacity, sizeof(*ls->reps));
+  ls->rep_slots = calloc(ls->rep_slots_capacity, sizeof(*ls->rep_slots));
+  return ls->entries && ls->reps && ls->rep_slots;
+}
+
+static void ledger_free(ledger_state_t *ls) {
+  if(ls->log) {
+    fclose(ls->log);
+    ls->log = NULL;
+  }
+  free(ls->entries);
+  free(ls->reps);
+  free(ls->rep_slots);
+  free(ls->undo);
+  ls->undo = NULL;
+  ls->entries = NULL;
+  ls->reps = NULL;
+  ls->rep_slots = NULL;
+}
+
+static bool log_append(ledger_state_t *ls, ledger_entry_t *entry) {
+  const char     tag = LEDGER_LOG_RECORD_TAG;
+  const uint8_t *rep_id = entry->rep ? ls->reps[entry->rep].id : zero_hash;
+  if(!ls->log) {
+    return true;
+  }
+  //reps are logged by id, so the log doesn't depend on the snapshot's rep numbering
+  if(fwrite(&tag, 1, 1, ls->log) == 1
+   && fwrite(entry, sizeof(*entry), 1, ls->log) == 1
+   && fwrite(rep_id, 32, 1, ls->log) == 1) {
+    ls->log_uncommitted++;
+    ls->log_entries++;
+    return true;
+  }
+  return false;
+}
+
+//read the next log record. returns its tag, or 0 at the end of the log or at a torn record
+static char log_read(FILE *f, ledger_entry_t *entry, uint8_t *rep_id) {
+  char tag;
+  if(fread(&tag, 1, 1, f) != 1) {
+    return 0;
+  }
+  switch(tag) {
+    case LEDGER_LOG_COMMIT_TAG:
+      return tag;
+    case LEDGER_LOG_RECORD_TAG:
+      if(fread(entry, sizeof(*entry), 1, f) == 1 && fread(rep_id, 32, 1, f) == 1) {
+        return tag;
+      }
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+static bool log_truncate(ledger_state_t *ls, long len) {
+  fflush(ls->log);
+  if(ftruncate(fileno(ls->log), len) != 0) {
+    return false;
+  }
+  fseek(ls->log, 0, SEEK_END);
+  ls->log_entries = len == 0 ? 0 : ls->log_entries - ls->log_uncommitted;
+  ls->log_committed = len;
+  ls->log_uncommitted = 0;
+  return true;
+}
+
+//keep the entry as it is now, to put back if the transaction changing it gets rolled back
+static bool undo_push(ledger_state_t *ls, const uint8_t *id) {
+  ledger_entry_t  *entry, *new_undo;
+  size_t           new_capacity;
+  if(!ls->log) {
+    return true;
+  }
+  if(ls->undo_count == ls->undo_capacity) {
+    new_capacity = ls->undo_capacity ? ls->undo_capacity * 2 : 256;
+    if((new_undo = realloc(ls->undo, new_capacity * sizeof(*new_undo))) == NULL) {
+      return false;
+    }
+    ls->undo = new_undo;
+    ls->undo_capacity = new_capacity;
+  }
+  if((entry = entry_find(ls, id)) != NULL) {
+    ls->undo[ls->undo_count] = *entry;
+  }
+  else {
+    memset(&ls->undo[ls->undo_count], 0, sizeof(*ls->undo));
+    memcpy(ls->undo[ls->undo_count].id, id, 32);
+  }
+  ls->undo_count++;
+  return true;
+}
+
+static void setfield_cfunction(lua_State *L, int tindex, const char *fname, lua_CFunction func) {
+  lua_pushcfunction(L, func);
+  if(tindex < 0) {
+    tindex--;
+  }
+  lua_setfield(L, tindex, fname);
+}
+
+static ledger_state_t *ledger_check(lua_State *L, int index) {
+  ledger_state_t *ls = luaL_checkudata(L, index, "prailude.ledgerstate");
+  if(!ls->entries) {
+    luaL_error(L, "ledger state has been freed");
+  }
+  return ls;
+}
+
+static const uint8_t *check_id(lua_State *L, int index) {
+  size_t       len;
+  const char  *id = luaL_checklstring(L, index, &len);
+  if(len != 32) {
+    luaL_argerror(L, index, "account id length must be 32");
+  }
+  return (const uint8_t *)id;
+}
+
+//read a fixed-size binary string from table field, false if the field is nil
+static bool rawget_fixed(lua_State *L, int tindex, const char *field, uint8_t *dst, size_t sz) {
+  size_t       len;
+  const char  *str;
+  bool         found = false;
+  lua_pushstring(L, field);
+  lua_rawget(L, tindex);
+  if(lua_type(L, -1) == LUA_TUSERDATA) {
+    //a balance, most likely. pack it
+    lua_getfield(L, -1, "pack");
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 1);
+    lua_remove(L, -2);
+  }
+  if(!lua_isnil(L, -1)) {
+    str = lua_tolstring(L, -1, &len);
+    if(str == NULL || len != sz) {
+      luaL_error(L, "field %s must be a %d-byte string", field, (int )sz);
+    }
+    memcpy(dst, str, sz);
+    found = true;
+  }
+  lua_pop(L, 1);
+  return found;
+}
+
+static int lua_ledger_new(lua_State *L) {
+  size_t           capacity = luaL_optinteger(L, 1, 0);
+  ledger_state_t  *ls = lua_newuserdata(L, sizeof(*ls));
+  if(!ledger_init(ls, capacity)) {
+    ledger_free(ls);
+    return luaL_error(L, "Out of memory, can't allocate ledger state");
+  }
+  luaL_getmetatable(L, "prailude.ledgerstate");
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int lua_ledger_gc(lua_State *L) {
+  ledger_state_t *ls = luaL_checkudata(L, 1, "prailude.ledgerstate");
+  ledger_free(ls);
+  return 0;
+}
+
+// ledger:set(acct) -- update the entry for acct.id from acct's fields. absent fields are left alone
+static int lua_ledger_set(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  ledger_entry_t  *entry;
+  uint8_t          id[32], rep[32];
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if(!rawget_fixed(L, 2, "id", id, 32)) {
+    return luaL_error(L, "account id missing");
+  }
+  if(!undo_push(ls, id) || (entry = entry_get_or_create(ls, id)) == NULL) {
+    return luaL_error(L, "Out of memory, can't grow ledger state");
+  }
+
+  rawget_fixed(L, 2, "frontier", entry->frontier, 32);
+  if(rawget_fixed(L, 2, "balance", entry->balance, 16)) {
+    entry->flags |= LEDGER_HAS_BALANCE;
+  }
+  if(rawget_fixed(L, 2, "representative", rep, 32)) {
+    if((entry->rep = rep_index(ls, rep)) == 0) {
+      return luaL_error(L, "Out of memory, can't grow ledger state representatives");
+    }
+  }
+
+  lua_pushliteral(L, "block_count");
+  lua_rawget(L, 2);
+  if(lua_isnumber(L, -1)) {
+    entry->block_count = lua_tonumber(L, -1);
+  }
+  lua_pop(L, 1);
+
+  lua_pushliteral(L, "delegated_balance");
+  lua_rawget(L, 2);
+  if(lua_isnumber(L, -1)) {
+    entry->weight = lua_tonumber(L, -1);
+  }
+  lua_pop(L, 1);
+
+  lua_pushliteral(L, "behind");
+  lua_rawget(L, 2);
+  if(!lua_isnil(L, -1)) {
+    if(lua_toboolean(L, -1)) {
+      entry->flags |= LEDGER_BEHIND;
+    }
+    else {
+      entry->flags &= ~LEDGER_BEHIND;
+    }
+  }
+  lua_pop(L, 1);
+
+  if(!log_append(ls, entry)) {
+    return luaL_error(L, "failed to write to ledger state log");
+  }
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// ledger:get(id[, tbl]) -- fill tbl (or a new table) with the account's fields, or nil if there's no such account
+static int lua_ledger_get(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  const uint8_t   *id = check_id(L, 2);
+  ledger_entry_t  *entry;
+  int              tindex;
+
+  if((entry = entry_find(ls, id)) == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  if(lua_istable(L, 3)) {
+    lua_settop(L, 3);
+  }
+  else {
+    lua_settop(L, 2);
+    lua_createtable(L, 0, 7);
+  }
+  tindex = lua_gettop(L);
+
+  lua_pushliteral(L, "id");
+  lua_pushlstring(L, (const char *)entry->id, 32);
+  lua_rawset(L, tindex);
+
+  if(memcmp(entry->frontier, zero_hash, 32) != 0) {
+    lua_pushliteral(L, "frontier");
+    lua_pushlstring(L, (const char *)entry->frontier, 32);
+    lua_rawset(L, tindex);
+  }
+  if(entry->flags & LEDGER_HAS_BALANCE) {
+    lua_pushliteral(L, "balance");
+    lua_pushlstring(L, (const char *)entry->balance, 16);
+    lua_rawset(L, tindex);
+  }
+  if(entry->rep) {
+    lua_pushliteral(L, "representative");
+    lua_pushlstring(L, (const char *)ls->reps[entry->rep].id, 32);
+    lua_rawset(L, tindex);
+  }
+
+  lua_pushliteral(L, "block_count");
+  lua_pushnumber(L, entry->block_count);
+  lua_rawset(L, tindex);
+
+  lua_pushliteral(L, "delegated_balance");
+  lua_pushnumber(L, entry->weight);
+  lua_rawset(L, tindex);
+
+  lua_pushliteral(L, "behind");
+  lua_pushboolean(L, entry->flags & LEDGER_BEHIND);
+  lua_rawset(L, tindex);
+
+  return 1;
+}
+
+static int lua_ledger_frontier(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  ledger_entry_t  *entry = entry_find(ls, check_id(L, 2));
+  if(entry == NULL || memcmp(entry->frontier, zero_hash, 32) == 0) {
+    lua_pushnil(L);
+  }
+  else {
+    lua_pushlstring(L, (const char *)entry->frontier, 32);
+  }
+  return 1;
+}
+
+static int lua_ledger_count(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  lua_pushnumber(L, ls->count);
+  return 1;
+}
+
+static void ledger_reset(ledger_state_t *ls) {
+  memset(ls->entries, 0, ls->capacity * sizeof(*ls->entries));
+  memset(ls->rep_slots, 0, ls->rep_slots_capacity * sizeof(*ls->rep_slots));
+  ls->count = 0;
+  ls->reps_count = 0;
+  ls->undo_count = 0;
+}
+
+static int lua_ledger_clear(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  ledger_reset(ls);
+  if(ls->log && !log_truncate(ls, 0)) {
+    return luaL_error(L, "failed to truncate ledger state log");
+  }
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+// ledger:write_snapshot(path[, log_path]) -- write the whole table out, then truncate the log.
+// the snapshot is written to path.tmp and moved into place, so a crash halfway through leaves the old one intact
+static int lua_ledger_write_snapshot(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  const char      *path = luaL_checkstring(L, 2);
+  char             tmppath[1024];
+  FILE            *f;
+  uint32_t         version = LEDGER_SNAPSHOT_VERSION, reps_count = ls->reps_count;
+  uint64_t         count = ls->count;
+  size_t           i;
+  bool             ok;
+
+  if(snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int )sizeof(tmppath)) {
+    return luaL_error(L, "snapshot path too long");
+  }
+  if((f = fopen(tmppath, "wb")) == NULL) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "can't open %s for writing", tmppath);
+    return 2;
+  }
+  ok = fwrite(LEDGER_SNAPSHOT_MAGIC, 8, 1, f) == 1
+    && fwrite(&version, sizeof(version), 1, f) == 1
+    && fwrite(&reps_count, sizeof(reps_count), 1, f) == 1
+    && fwrite(&count, sizeof(count), 1, f) == 1
+    && (reps_count == 0 || fwrite(&ls->reps[1], sizeof(*ls->reps), reps_count, f) == reps_count);
+  for(i = 0; ok && i < ls->capacity; i++) {
+    if(ls->entries[i].flags & LEDGER_USED) {
+      ok = fwrite(&ls->entries[i], sizeof(ls->entries[i]), 1, f) == 1;
+    }
+  }
+  if(fclose(f) != 0 || !ok || rename(tmppath, path) != 0) {
+    remove(tmppath);
+    lua_pushnil(L);
+    lua_pushfstring(L, "failed to write ledger snapshot %s", path);
+    return 2;
+  }
+
+  //everything in the log is in the snapshot now
+  if(ls->log && !log_truncate(ls, 0)) {
+    return luaL_error(L, "failed to truncate ledger state log");
+  }
+
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+// ledger:read_snapshot(path) -- load a snapshot into an empty table. nil, err if it's not there or is broken
+static int lua_ledger_read_snapshot(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  const char      *path = luaL_checkstring(L, 2);
+  FILE            *f;
+  char             magic[8];
+  uint32_t         version, reps_count, i;
+  uint64_t         count, n;
+  ledger_entry_t   entry, *cur;
+  ledger_rep_t     rep;
+  const char      *err = NULL;
+
+  if(ls->count > 0) {
+    return luaL_error(L, "ledger state must be empty to load a snapshot");
+  }
+  if((f = fopen(path, "rb")) == NULL) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "no ledger snapshot at %s", path);
+    return 2;
+  }
+  if(fread(magic, 8, 1, f) != 1 || memcmp(magic, LEDGER_SNAPSHOT_MAGIC, 8) != 0
+   || fread(&version, sizeof(version), 1, f) != 1 || version != LEDGER_SNAPSHOT_VERSION
+   || fread(&reps_count, sizeof(reps_count), 1, f) != 1
+   || fread(&count, sizeof(count), 1, f) != 1) {
+    err = "bad ledger snapshot header";
+  }
+  for(i = 0; !err && i < reps_count; i++) {
+    if(fread(&rep, sizeof(rep), 1, f) != 1) {
+      err = "truncated ledger snapshot";
+    }
+    else if(rep_index(ls, rep.id) != i + 1) {
+      err = "Out of memory or duplicate rep while loading ledger snapshot";
+    }
+  }
+  for(n = 0; !err && n < count; n++) {
+    if(fread(&entry, sizeof(entry), 1, f) != 1) {
+      err = "truncated ledger snapshot";
+    }
+    else if(entry.rep > reps_count) {
+      err = "corrupt ledger snapshot";
+    }
+    else if((cur = entry_get_or_create(ls, entry.id)) == NULL) {
+      err = "Out of memory while loading ledger snapshot";
+    }
+    else {
+      *cur = entry;
+    }
+  }
+  fclose(f);
+
+  if(err) {
+    ledger_reset(ls);
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+  }
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+// ledger:open_log(path[, replayed_ids]) -- replay the committed entries already in the log, then keep
+// appending changes to it. the ids of the replayed entries are added to the replayed_ids array, if given
+static int lua_ledger_open_log(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  const char      *path = luaL_checkstring(L, 2);
+  FILE            *f;
+  char             tag;
+  ledger_entry_t   entry, *cur;
+  uint8_t          rep_id[32];
+  size_t           replayed = 0;
+  long             good_end = 0;
+
+  if(ls->log) {
+    return luaL_error(L, "ledger state log already open");
+  }
+  if((f = fopen(path, "a+b")) == NULL) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "can't open ledger state log %s", path);
+    return 2;
+  }
+  //find the last commit marker first. nothing after it gets replayed
+  rewind(f);
+  while((tag = log_read(f, &entry, rep_id)) != 0) {
+    if(tag == LEDGER_LOG_COMMIT_TAG) {
+      good_end = ftell(f);
+    }
+  }
+  rewind(f);
+  while(ftell(f) < good_end && (tag = log_read(f, &entry, rep_id)) != 0) {
+    if(tag != LEDGER_LOG_RECORD_TAG) {
+      continue;
+    }
+    if((cur = entry_get_or_create(ls, entry.id)) == NULL) {
+      fclose(f);
+      return luaL_error(L, "Out of memory while replaying ledger state log");
+    }
+    entry.rep = memcmp(rep_id, zero_hash, 32) == 0 ? 0 : rep_index(ls, rep_id);
+    *cur = entry;
+    replayed++;
+    if(lua_istable(L, 3)) {
+      lua_pushlstring(L, (const char *)entry.id, 32);
+      lua_rawseti(L, 3, lua_rawlen(L, 3) + 1);
+    }
+  }
+  //uncommitted entries and any torn record at the end from a crash mid-write get cut off
+  ls->log = f;
+  ls->log_entries = replayed;
+  ls->log_uncommitted = 0;
+  if(!log_truncate(ls, good_end)) {
+    ls->log = NULL;
+    fclose(f);
+    return luaL_error(L, "failed to truncate ledger state log");
+  }
+
+  lua_pushnumber(L, replayed);
+  return 1;
+}
+
+// ledger:commit() -- mark everything logged so far as committed. called whenever the db commits a transaction
+static int lua_ledger_commit(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  const char       tag = LEDGER_LOG_COMMIT_TAG;
+  if(ls->log && ls->log_uncommitted > 0) {
+    if(fwrite(&tag, 1, 1, ls->log) != 1) {
+      return luaL_error(L, "failed to write to ledger state log");
+    }
+    ls->log_committed = ftell(ls->log);
+    ls->log_uncommitted = 0;
+  }
+  ls->undo_count = 0;
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+// ledger:rollback() -- put every entry changed since the last commit back the way it was, and drop
+// their log entries
+static int lua_ledger_rollback(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  ledger_entry_t  *prev, *cur;
+  //newest first, so each entry ends up as it was before its first change
+  while(ls->undo_count > 0) {
+    prev = &ls->undo[--ls->undo_count];
+    cur = entry_find(ls, prev->id);
+    if(prev->flags & LEDGER_USED) {
+      //it was there before, so it's still there now
+      *cur = *prev;
+    }
+    else if(cur) {
+      entry_delete(ls, cur);
+    }
+  }
+  if(ls->log && ls->log_uncommitted > 0 && !log_truncate(ls, ls->log_committed)) {
+    return luaL_error(L, "failed to truncate ledger state log");
+  }
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+// ledger:log_count() -- how many entries are in the log, waiting to be folded into a snapshot
+static int lua_ledger_log_count(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  lua_pushnumber(L, ls->log_entries);
+  return 1;
+}
+
+//push buffered log records to the OS. called once per batch of ledger updates, not per update
+static int lua_ledger_flush(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  if(ls->log && fflush(ls->log) != 0) {
+    return luaL_error(L, "failed to flush ledger state log");
+  }
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+static int lua_ledger_close_log(lua_State *L) {
+  ledger_state_t  *ls = ledger_check(L, 1);
+  if(ls->log) {
+    fclose(ls->log);
+    ls->log = NULL;
+  }
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+static const struct luaL_Reg prailude_ledgerstate_functions[] = {
+  { "new", lua_ledger_new },
+
+  { NULL, NULL }
+};
+
+int luaopen_prailude_util_ledgerstate(lua_State* L) {
+  luaL_newmetatable(L, "prailude.ledgerstate");
+
+  //__index
+  lua_createtable(L, 0, 14);
+  setfield_cfunction(L, -1, "get",            lua_ledger_get);
+  setfield_cfunction(L, -1, "set",            lua_ledger_set);
+  setfield_cfunction(L, -1, "frontier",       lua_ledger_frontier);
+  setfield_cfunction(L, -1, "count",          lua_ledger_count);
+  setfield_cfunction(L, -1, "clear",          lua_ledger_clear);
+  setfield_cfunction(L, -1, "write_snapshot", lua_ledger_write_snapshot);
+  setfield_cfunction(L, -1, "read_snapshot",  lua_ledger_read_snapshot);
+  setfield_cfunction(L, -1, "open_log",       lua_ledger_open_log);
+  setfield_cfunction(L, -1, "commit",         lua_ledger_commit);
+  setfield_cfunction(L, -1, "rollback",       lua_ledger_rollback);
+  setfield_cfunction(L, -1, "log_count",      lua_ledger_log_count);
+  setfield_cfunction(L, -1, "flush",          lua_ledger_flush);
+  setfield_cfunction(L, -1, "close_log",      lua_ledger_close_log);
+  lua_setfield(L, -2, "__index");
+
+  setfield_cfunction(L, -1, "__gc", lua_ledger_gc);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+#if LUA_VERSION_NUM > 501
+  luaL_setfuncs(L,prailude_ledgerstate_functions,0);
+#else
+  luaL_register(L, NULL, prailude_ledgerstate_functions);
+#endif
+  return 1;
+}
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pagefile.h"
+
+// scratch file for spilled PageQueue pages of 32-byte ids.
+// the file is carved into fixed-size slots of `slot_items` ids each. a page takes as many
+// slots as it needs, freed slots go on a free-list and get reused before the file grows.
+// the file is unlinked as soon as it's opened, so it never outlives the process.
+
+#define PAGEFILE_ITEM_SIZE 32
+
+#if LUA_VERSION_NUM > 501
+#define pagefile_objlen lua_rawlen
+#else
+#define pagefile_objlen lua_objlen
+#endif
+
+typedef struct {
+  uint32_t    count;    //ids in the page
+  uint32_t    nslots;
+  uint32_t   *slots;
+} pagefile_page_t;
+
+typedef struct {
+  int               fd;
+  size_t            slot_items;
+  size_t            slot_size;
+
+  pagefile_page_t  *pages;      //indexed by page id
+  size_t            pages_len;
+
+  uint32_t         *free_slots; //free-list, used as a stack
+  size_t            free_len;
+  size_t            free_cap;
+  uint32_t          total_slots;
+
+  char             *buf;        //one slot's worth
+} pagefile_t;
+
+static void setfield_cfunction(lua_State *L, int tindex, const char *fname, lua_CFunction func) {
+  lua_pushcfunction(L, func);
+  if(tindex < 0) {
+    tindex--;
+  }
+  lua_setfield(L, tindex, fname);
+}
+
+static pagefile_t *pagefile_check(lua_State *L, int index) {
+  pagefile_t *pf = luaL_checkudata(L, index, "prailude.pagefile");
+  if(pf->fd == -1) {
+    luaL_error(L, "pagefile is closed");
+  }
+  return pf;
+}
+
+static pagefile_page_t *page_get(pagefile_t *pf, lua_Number page_id) {
+  if(page_id < 0 || page_id >= pf->pages_len) {
+    return NULL;
+  }
+  return &pf->pages[(size_t )page_id];
+}
+
+static bool free_push(pagefile_t *pf, uint32_t slot) {
+  uint32_t *new_free;
+  if(pf->free_len == pf->free_cap) {
+    if((new_free = realloc(pf->free_slots, (pf->free_cap * 2 + 16) * sizeof(*new_free))) == NULL) {
+      return false;
+    }
+    pf->free_slots = new_free;
+    pf->free_cap = pf->free_cap * 2 + 16;
+  }
+  pf->free_slots[pf->free_len++] = slot;
+  return true;
+}
+
+static uint32_t slot_alloc(pagefile_t *pf) {
+  if(pf->free_len > 0) {
+    return pf->free_slots[--pf->free_len];
+  }
+  return pf->total_slots++; //append
+}
+
+static void page_free(pagefile_t *pf, pagefile_page_t *page) {
+  uint32_t i;
+  //pushed in reverse, so they pop back off in file order
+  for(i = page->nslots; i > 0; i--) {
+    if(!free_push(pf, page->slots[i - 1])) {
+      break; //out of memory. the slot leaks, the file is scratch anyway
+    }
+  }
+  free(page->slots);
+  memset(page, 0, sizeof(*page));
+}
+
+static bool pwrite_all(int fd, const char *buf, size_t len, off_t off) {
+  ssize_t n;
+  while(len > 0) {
+    if((n = pwrite(fd, buf, len, off)) < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+static bool pread_all(int fd, char *buf, size_t len, off_t off) {
+  ssize_t n;
+  while(len > 0) {
+    if((n = pread(fd, buf, len, off)) <= 0) {
+      if(n < 0 && errno == EINTR) continue;
+      return false;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+// PageFile.open(path, slot_items)
+static int lua_pagefile_open(lua_State *L) {
+  const char   *path = luaL_checkstring(L, 1);
+  lua_Number    slot_items = luaL_optnumber(L, 2, 5000);
+  pagefile_t   *pf;
+
+  luaL_argcheck(L, slot_items >= 1, 2, "slot size must be at least 1 item");
+  pf = lua_newuserdata(L, sizeof(*pf));
+  memset(pf, 0, sizeof(*pf));
+  pf->fd = -1;
+  luaL_getmetatable(L, "prailude.pagefile");
+  lua_setmetatable(L, -2);
+
+  pf->slot_items = slot_items;
+  pf->slot_size = pf->slot_items * PAGEFILE_ITEM_SIZE;
+  if((pf->buf = malloc(pf->slot_size)) == NULL) {
+    return luaL_error(L, "Out of memory, can't allocate pagefile buffer");
+  }
+  if((pf->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "can't open pagefile %s: %s", path, strerror(errno));
+    return 2;
+  }
+  unlink(path);
+  return 1;
+}
+
+// pf:store(page_id, ids) -- ids is an array of 32-byte strings. replaces whatever page_id had
+static int lua_pagefile_store(lua_State *L) {
+  pagefile_t       *pf = pagefile_check(L, 1);
+  lua_Number        page_id = luaL_checknumber(L, 2);
+  size_t            count, nslots, i, j, n, len;
+  pagefile_page_t  *page, *new_pages;
+  const char       *id;
+
+  luaL_argcheck(L, page_id >= 0 && page_id < UINT32_MAX, 2, "bad page id");
+  luaL_checktype(L, 3, LUA_TTABLE);
+  count = pagefile_objlen(L, 3);
+  nslots = (count + pf->slot_items - 1) / pf->slot_items;
+
+  if(page_id >= pf->pages_len) {
+    size_t new_len = pf->pages_len * 2 + 16;
+    while(new_len <= page_id) new_len *= 2;
+    if((new_pages = realloc(pf->pages, new_len * sizeof(*new_pages))) == NULL) {
+      return luaL_error(L, "Out of memory, can't grow pagefile page table");
+    }
+    memset(&new_pages[pf->pages_len], 0, (new_len - pf->pages_len) * sizeof(*new_pages));
+    pf->pages = new_pages;
+    pf->pages_len = new_len;
+  }
+  page = page_get(pf, page_id);
+  if(page->slots) {
+    page_free(pf, page);
+  }
+  if(nslots > 0 && (page->slots = malloc(nslots * sizeof(*page->slots))) == NULL) {
+    return luaL_error(L, "Out of memory, can't allocate pagefile page");
+  }
+
+  for(i = 0; i < nslots; i++) {
+    n = count - i * pf->slot_items;
+    if(n > pf->slot_items) n = pf->slot_items;
+    for(j = 0; j < n; j++) {
+      lua_rawgeti(L, 3, i * pf->slot_items + j + 1);
+      id = lua_tolstring(L, -1, &len);
+      if(id == NULL || len != PAGEFILE_ITEM_SIZE) {
+        page->nslots = i;
+        page_free(pf, page);
+        return luaL_error(L, "pagefile items must be %d-byte strings", PAGEFILE_ITEM_SIZE);
+      }
+      memcpy(&pf->buf[j * PAGEFILE_ITEM_SIZE], id, PAGEFILE_ITEM_SIZE);
+      lua_pop(L, 1);
+    }
+    page->slots[i] = slot_alloc(pf);
+    page->nslots = i + 1;
+    if(!pwrite_all(pf->fd, pf->buf, n * PAGEFILE_ITEM_SIZE, (off_t )page->slots[i] * pf->slot_size)) {
+      page_free(pf, page);
+      return luaL_error(L, "pagefile write failed: %s", strerror(errno));
+    }
+  }
+  page->count = count;
+
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+// pf:load(page_id) -- returns the page's ids, and frees it
+static int lua_pagefile_load(lua_State *L) {
+  pagefile_t       *pf = pagefile_check(L, 1);
+  pagefile_page_t  *page = page_get(pf, luaL_checknumber(L, 2));
+  size_t            i, j, n, k = 1;
+
+  if(page == NULL || page->count == 0) {
+    if(page) page_free(pf, page);
+    lua_newtable(L);
+    return 1;
+  }
+  lua_createtable(L, page->count, 0);
+  for(i = 0; i < page->nslots; i++) {
+    n = page->count - i * pf->slot_items;
+    if(n > pf->slot_items) n = pf->slot_items;
+    if(!pread_all(pf->fd, pf->buf, n * PAGEFILE_ITEM_SIZE, (off_t )page->slots[i] * pf->slot_size)) {
+      return luaL_error(L, "pagefile read failed: %s", errno ? strerror(errno) : "short read");
+    }
+    for(j = 0; j < n; j++) {
+      lua_pushlstring(L, &pf->buf[j * PAGEFILE_ITEM_SIZE], PAGEFILE_ITEM_SIZE);
+      lua_rawseti(L, -2, k++);
+    }
+  }
+  page_free(pf, page);
+  return 1;
+}
+
+static int lua_pagefile_size(lua_State *L) {
+  pagefile_t       *pf = pagefile_check(L, 1);
+  pagefile_page_t  *page = page_get(pf, luaL_checknumber(L, 2));
+  lua_pushnumber(L, page ? page->count : 0);
+  return 1;
+}
+
+static int lua_pagefile_delete(lua_State *L) {
+  pagefile_t       *pf = pagefile_check(L, 1);
+  pagefile_page_t  *page = page_get(pf, luaL_checknumber(L, 2));
+  size_t            count = 0;
+  if(page) {
+    count = page->count;
+    page_free(pf, page);
+  }
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+static int lua_pagefile_stats(lua_State *L) {
+  pagefile_t  *pf = pagefile_check(L, 1);
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, pf->total_slots);
+  lua_setfield(L, -2, "slots");
+  lua_pushnumber(L, pf->free_len);
+  lua_setfield(L, -2, "free_slots");
+  lua_pushnumber(L, (lua_Number )pf->total_slots * pf->slot_size);
+  lua_setfield(L, -2, "file_size");
+  return 1;
+}
+
+static int lua_pagefile_close(lua_State *L) {
+  pagefile_t  *pf = luaL_checkudata(L, 1, "prailude.pagefile");
+  size_t       i;
+  if(pf->fd != -1) {
+    close(pf->fd);
+    pf->fd = -1;
+  }
+  for(i = 0; i < pf->pages_len; i++) {
+    free(pf->pages[i].slots);
+  }
+  free(pf->pages);
+  free(pf->free_slots);
+  free(pf->buf);
+  pf->pages = NULL;
+  pf->free_slots = NULL;
+  pf->buf = NULL;
+  pf->pages_len = pf->free_len = pf->free_cap = 0;
+  return 0;
+}
+
+static const struct luaL_Reg prailude_pagefile_functions[] = {
+  { "open", lua_pagefile_open },
+
+  { NULL, NULL }
+};
+
+int luaopen_prailude_util_pagefile(lua_State* L) {
+  luaL_newmetatable(L, "prailude.pagefile");
+
+  //__index
+  lua_createtable(L, 0, 6);
+  setfield_cfunction(L, -1, "store",  lua_pagefile_store);
+  setfield_cfunction(L, -1, "load",   lua_pagefile_load);
+  setfield_cfunction(L, -1, "size",   lua_pagefile_size);
+  setfield_cfunction(L, -1, "delete", lua_pagefile_delete);
+  setfield_cfunction(L, -1, "stats",  lua_pagefile_stats);
+  setfield_cfunction(L, -1, "close",  lua_pagefile_close);
+  lua_setfield(L, -2, "__index");
+
+  setfield_cfunction(L, -1, "__gc", lua_pagefile_close);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+#if LUA_VERSION_NUM > 501
+  luaL_setfuncs(L,prailude_pagefile_functions,0);
+#else
+  luaL_register(L, NULL, prailude_pagefile_functions);
+#endif
+  return 1;
+}
@@ -1036,8 +1036,8 @@ static int prailude_unpack_bulk(lua_State *L) {
     return 2;
   }
   else if(done) {
-    //discard leftovers
-    lua_pushnil(L);
+    //whatever's past the end of the stream, so the caller can tell if the connection's still clean
+    lua_pushlstring(L, cur, (end - cur));
     lua_pushboolean(L, 1);
     return 3;
   }
@@ -1,11 +1,73 @@
 local uv = require "luv"
 local coroutine = require "prailude.util.coroutine"
+local Wheel = require "prailude.util.timerwheel"
+local log = require "prailude.log"
+
+--every timer goes on one hierarchical timing wheel, driven by a single one-shot uv timer. it's armed
+-- for the next time the wheel has anything to do, so an idle wheel doesn't wake the loop up.
+-- whatever comes due in a tick is run as a batch
+local TICK = 5 --ms. timers fire on the first tick at or after they're due
+
+local wheel = Wheel.new(TICK, uv.now())
+local pending = {} --wheel id -> timer
+local driver = uv.new_timer()
+local armed --when the driver's set to go off, nil if it isn't
+local run_timers
+
+local function arm(at)
+  armed = at
+  uv.timer_start(driver, math.max(0, math.ceil(at - uv.now())), 0, run_timers)
+end
 
 local Timer = {}
+
+local Timer_meta = {__index = {
+  stop = function(self)
+    return Timer.cancel(self)
+  end
+}}
+
+function run_timers()
+  armed = nil
+  local expired = wheel:advance(uv.now())
+  if expired then
+    for _, id in ipairs(expired) do
+      local timer = pending[id]
+      if timer then
+        pending[id] = nil
+        timer.id = nil
+        local ok, err = pcall(timer.ontimeout, timer)
+        if not ok then
+          log:error("timer: %s", tostring(err))
+        end
+      end
+    end
+  end
+  --the callbacks may have armed it already, for something new that's due sooner
+  local next_at = wheel:next()
+  if next_at and (not armed or next_at < armed) then
+    arm(next_at)
+  end
+end
+
+local function schedule(timer, delay)
+  local now = uv.now()
+  if wheel:count() == 0 then
+    --the wheel's clock stood still while it was empty. catching it up now is a jump, not a walk
+    wheel:advance(now)
+  end
+  local id, due = wheel:add(now + delay)
+  timer.id = id
+  pending[id] = timer
+  if not armed or due < armed then
+    arm(due)
+  end
+  return timer
+end
+
 function Timer.delay(delay, callback)
   assert(type(delay)=="number", "delay must be a number")
-  
-  local timer = uv.new_timer()
+
   local coro
   if not callback then
     coro = coroutine.running()
@@ -14,12 +76,10 @@ function Timer.delay(delay, callback)
       coroutine.resume(coro)
     end
   end
-  local function ontimeout()
-    uv.timer_stop(timer)
-    uv.close(timer)
+  local timer = setmetatable({ontimeout = function()
     callback()
-  end
-  uv.timer_start(timer, delay, 0, ontimeout)
+  end}, Timer_meta)
+  schedule(timer, delay)
   if coro then
     return coroutine.yield()
   else
@@ -30,19 +90,27 @@ end
 function Timer.interval(interval, callback)
   assert(type(interval)=="number", "interval must be a number")
   assert(type(callback)=="function", "callback must be a function")
-  local timer = uv.new_timer()
-  local function ontimeout()
+  local timer = setmetatable({}, Timer_meta)
+  timer.ontimeout = function()
+    schedule(timer, interval)
     if callback(timer) == false then
       Timer.cancel(timer)
     end
   end
-  uv.timer_start(timer, interval, interval, ontimeout)
-  return timer
+  return schedule(timer, interval)
 end
 
 function Timer.cancel(timer)
-  uv.timer_stop(timer)
-  uv.close(timer)
+  local id = timer.id
+  if id then
+    wheel:cancel(id)
+    pending[id] = nil
+    timer.id = nil
+    if armed and wheel:count() == 0 then
+      uv.timer_stop(driver)
+      armed = nil
+    end
+  end
 end
 
 return Timer
@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timerwheel.h"
+
+// hierarchical timing wheel: 4 levels of 256 slots, each level's slot spanning a whole turn of the
+// level below it, so 2^32 ticks in all. a timer goes in the lowest level its due tick fits in, and
+// gets cascaded down a level each time the wheel below comes back around to it.
+// insert and cancel are O(1): timers are nodes in a pool, doubly-linked into their slot.
+// timers are identified by a number that's the node index plus a generation count, so a stale id
+// for a reused node doesn't cancel someone else's timer.
+// times are in ms, the same clock as uv.now(). the wheel only deals in ids, callbacks stay in lua.
+
+#define WHEEL_LEVELS      4
+#define WHEEL_SLOT_BITS   8
+#define WHEEL_SLOTS       (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_DELTA   0xFFFFFFFFULL
+#define WHEEL_INDEX_BITS  22 //up to 4M timers at once. leaves 31 bits of generation in a double's 53
+#define WHEEL_MAX_NODES   (1 << WHEEL_INDEX_BITS)
+#define WHEEL_NIL         UINT32_MAX
+
+typedef struct {
+  uint64_t   due;       //tick
+  uint32_t   prev;
+  uint32_t   next;      //also the free-list link
+  uint32_t   gen;
+  uint16_t   slot;      //level * WHEEL_SLOTS + slot index
+  bool       pending;
+} wheel_node_t;
+
+typedef struct {
+  double         tick_ms;
+  double         base_ms;   //time at tick 0
+  uint64_t       now;       //current tick
+  uint32_t       heads[WHEEL_LEVELS * WHEEL_SLOTS];
+  wheel_node_t  *nodes;
+  uint32_t       nodes_len;
+  uint32_t       nodes_cap;
+  uint32_t       free_head;
+  uint32_t       count;
+} wheel_t;
+
+static void setfield_cfunction(lua_State *L, int tindex, const char *fname, lua_CFunction func) {
+  lua_pushcfunction(L, func);
+  if(tindex < 0) {
+    tindex--;
+  }
+  lua_setfield(L, tindex, fname);
+}
+
+static wheel_t *wheel_check(lua_State *L, int index) {
+  wheel_t *w = luaL_checkudata(L, index, "prailude.timerwheel");
+  if(w->nodes == NULL && w->nodes_cap != 0) {
+    luaL_error(L, "timer wheel has been freed");
+  }
+  return w;
+}
+
+static void slot_link(wheel_t *w, uint32_t n) {
+  wheel_node_t  *node = &w->nodes[n];
+  uint64_t       delta = node->due - w->now;
+  int            level;
+  uint32_t       slot;
+
+  if(delta > WHEEL_MAX_DELTA) {
+    delta = WHEEL_MAX_DELTA;
+    node->due = w->now + delta;
+  }
+  for(level = 0; level < WHEEL_LEVELS - 1; level++) {
+    if(delta < (1ULL << (WHEEL_SLOT_BITS * (level + 1)))) {
+      break;
+    }
+  }
+  slot = level * WHEEL_SLOTS + ((node->due >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK);
+
+  node->slot = slot;
+  node->prev = WHEEL_NIL;
+  node->next = w->heads[slot];
+  if(node->next != WHEEL_NIL) {
+    w->nodes[node->next].prev = n;
+  }
+  w->heads[slot] = n;
+}
+
+static void slot_unlink(wheel_t *w, uint32_t n) {
+  wheel_node_t *node = &w->nodes[n];
+  if(node->prev != WHEEL_NIL) {
+    w->nodes[node->prev].next = node->next;
+  }
+  else {
+    w->heads[node->slot] = node->next;
+  }
+  if(node->next != WHEEL_NIL) {
+    w->nodes[node->next].prev = node->prev;
+  }
+}
+
+static void node_free(wheel_t *w, uint32_t n) {
+  wheel_node_t *node = &w->nodes[n];
+  node->pending = false;
+  node->gen++;
+  node->next = w->free_head;
+  w->free_head = n;
+  w->count--;
+}
+
+static double node_id(wheel_t *w, uint32_t n) {
+  return (double )w->nodes[n].gen * WHEEL_MAX_NODES + n;
+}
+
+static uint64_t ms_to_tick(wheel_t *w, double ms) {
+  double ticks = (ms - w->base_ms) / w->tick_ms;
+  return ticks <= 0 ? 0 : (uint64_t )ticks;
+}
+
+//re-file everything in a higher-level slot, now that the level below has come around to it
+static void cascade(wheel_t *w, int level) {
+  uint32_t slot = level * WHEEL_SLOTS + ((w->now >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK);
+  uint32_t n = w->heads[slot], next;
+  w->heads[slot] = WHEEL_NIL;
+  while(n != WHEEL_NIL) {
+    next = w->nodes[n].next;
+    slot_link(w, n);
+    n = next;
+  }
+}
+
+//the next tick after now when anything happens: a level-0 slot with timers in it comes up, or a
+// higher-level slot with timers in it gets cascaded. UINT64_MAX if the wheel's empty
+static uint64_t next_tick(wheel_t *w) {
+  uint64_t   best = UINT64_MAX, base;
+  uint32_t   i;
+  int        level, shift;
+
+  if(w->count == 0) {
+    return best;
+  }
+  for(i = 1; i < WHEEL_SLOTS; i++) {
+    if(w->heads[(w->now + i) & WHEEL_SLOT_MASK] != WHEEL_NIL) {
+      best = w->now + i;
+      break;
+    }
+  }
+  for(level = 1; level < WHEEL_LEVELS; level++) {
+    shift = WHEEL_SLOT_BITS * level;
+    base = w->now >> shift;
+    //a full turn around, back to the current slot: it's been cascaded already, so anything in it is due next time around
+    for(i = 1; i <= WHEEL_SLOTS; i++) {
+      if(w->heads[level * WHEEL_SLOTS + ((base + i) & WHEEL_SLOT_MASK)] != WHEEL_NIL) {
+        if(((base + i) << shift) < best) {
+          best = (base + i) << shift;
+        }
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+static double tick_to_ms(wheel_t *w, uint64_t tick) {
+  return (double )tick * w->tick_ms + w->base_ms;
+}
+
+// Wheel.new(tick_ms, now_ms)
+static int lua_wheel_new(lua_State *L) {
+  double    tick_ms = luaL_checknumber(L, 1);
+  double    now_ms = luaL_checknumber(L, 2);
+  wheel_t  *w;
+  int       i;
+
+  luaL_argcheck(L, tick_ms > 0, 1, "tick must be positive");
+  w = lua_newuserdata(L, sizeof(*w));
+  memset(w, 0, sizeof(*w));
+  luaL_getmetatable(L, "prailude.timerwheel");
+  lua_setmetatable(L, -2);
+
+  w->tick_ms = tick_ms;
+  w->base_ms = now_ms;
+  w->free_head = WHEEL_NIL;
+  for(i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++) {
+    w->heads[i] = WHEEL_NIL;
+  }
+  return 1;
+}
+
+// w:add(due_ms) -- timer id, and when it's actually due: the first tick at or after due_ms, and never the current one
+static int lua_wheel_add(lua_State *L) {
+  wheel_t       *w = wheel_check(L, 1);
+  double         due_ms = luaL_checknumber(L, 2);
+  uint64_t       due;
+  uint32_t       n;
+  wheel_node_t  *new_nodes;
+
+  if(w->free_head != WHEEL_NIL) {
+    n = w->free_head;
+    w->free_head = w->nodes[n].next;
+  }
+  else {
+    if(w->nodes_len == w->nodes_cap) {
+      uint32_t new_cap = w->nodes_cap * 2 + 64;
+      if(new_cap > WHEEL_MAX_NODES) new_cap = WHEEL_MAX_NODES;
+      if(new_cap == w->nodes_cap) {
+        return luaL_error(L, "too many timers");
+      }
+      if((new_nodes = realloc(w->nodes, new_cap * sizeof(*new_nodes))) == NULL) {
+        return luaL_error(L, "Out of memory, can't grow timer wheel");
+      }
+      w->nodes = new_nodes;
+      w->nodes_cap = new_cap;
+    }
+    n = w->nodes_len++;
+    w->nodes[n].gen = 0;
+  }
+
+  due = ms_to_tick(w, due_ms);
+  //round up to the next tick boundary
+  if(tick_to_ms(w, due) < due_ms) {
+    due++;
+  }
+  if(due <= w->now) {
+    due = w->now + 1;
+  }
+  w->nodes[n].due = due;
+  w->nodes[n].pending = true;
+  slot_link(w, n);
+  w->count++;
+
+  lua_pushnumber(L, node_id(w, n));
+  lua_pushnumber(L, tick_to_ms(w, due));
+  return 2;
+}
+
+// w:cancel(id) -- true if the timer was still pending
+static int lua_wheel_cancel(lua_State *L) {
+  wheel_t  *w = wheel_check(L, 1);
+  double    id = luaL_checknumber(L, 2);
+  double    gen = (double )(uint64_t )(id / WHEEL_MAX_NODES);
+  double    index = id - gen * WHEEL_MAX_NODES;
+  uint32_t  n;
+
+  if(index < 0 || index >= w->nodes_len) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  n = (uint32_t )index;
+  if(!w->nodes[n].pending || w->nodes[n].gen != (uint32_t )gen) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  slot_unlink(w, n);
+  node_free(w, n);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// w:advance(now_ms) -- array of the ids of timers that came due, or nil if none did
+static int lua_wheel_advance(lua_State *L) {
+  wheel_t   *w = wheel_check(L, 1);
+  uint64_t   target = ms_to_tick(w, luaL_checknumber(L, 2)), tick;
+  uint32_t   slot, n, next;
+  int        level, expired = 0;
+
+  if(w->count == 0) {
+    //nothing to run into on the way
+    if(target > w->now) {
+      w->now = target;
+    }
+    lua_pushnil(L);
+    return 1;
+  }
+  while(w->now < target && w->count > 0) {
+    //skip straight past the ticks where nothing happens
+    if((tick = next_tick(w)) > target) {
+      break;
+    }
+    w->now = tick;
+    for(level = 1; level < WHEEL_LEVELS; level++) {
+      if(((w->now >> (WHEEL_SLOT_BITS * (level - 1))) & WHEEL_SLOT_MASK) != 0) {
+        break;
+      }
+      cascade(w, level);
+    }
+    slot = w->now & WHEEL_SLOT_MASK;
+    n = w->heads[slot];
+    w->heads[slot] = WHEEL_NIL;
+    while(n != WHEEL_NIL) {
+      next = w->nodes[n].next;
+      if(expired == 0) {
+        lua_newtable(L);
+      }
+      lua_pushnumber(L, node_id(w, n));
+      lua_rawseti(L, -2, ++expired);
+      node_free(w, n);
+      n = next;
+    }
+  }
+  if(w->now < target) {
+    w->now = target;
+  }
+  if(expired == 0) {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// w:next() -- when the driver should next advance the wheel, in ms, or nil if it's empty.
+// that's either when the next timer is due, or when a higher level's next timers get cascaded down
+static int lua_wheel_next(lua_State *L) {
+  wheel_t   *w = wheel_check(L, 1);
+  uint64_t   tick = next_tick(w);
+  if(tick == UINT64_MAX) {
+    lua_pushnil(L);
+  }
+  else {
+    lua_pushnumber(L, tick_to_ms(w, tick));
+  }
+  return 1;
+}
+
+static int lua_wheel_count(lua_State *L) {
+  wheel_t *w = wheel_check(L, 1);
+  lua_pushnumber(L, w->count);
+  return 1;
+}
+
+static int lua_wheel_gc(lua_State *L) {
+  wheel_t *w = luaL_checkudata(L, 1, "prailude.timerwheel");
+  free(w->nodes);
+  w->nodes = NULL;
+  return 0;
+}
+
+static const struct luaL_Reg prailude_timerwheel_functions[] = {
+  { "new", lua_wheel_new },
+
+  { NULL, NULL }
+};
+
+int luaopen_prailude_util_timerwheel(lua_State* L) {
+  luaL_newmetatable(L, "prailude.timerwheel");
+
+  //__index
+  lua_createtable(L, 0, 5);
+  setfield_cfunction(L, -1, "add",     lua_wheel_add);
+  setfield_cfunction(L, -1, "cancel",  lua_wheel_cancel);
+  setfield_cfunction(L, -1, "advance", lua_wheel_advance);
+  setfield_cfunction(L, -1, "next",    lua_wheel_next);
+  setfield_cfunction(L, -1, "count",   lua_wheel_count);
+  lua_setfield(L, -2, "__index");
+
+  setfield_cfunction(L, -1, "__gc", lua_wheel_gc);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+#if LUA_VERSION_NUM > 501
+  luaL_setfuncs(L,prailude_timerwheel_functions,0);
+#else
+  luaL_register(L, NULL, prailude_timerwheel_functions);
+#endif
+  return 1;
+}
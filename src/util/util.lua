@@ -37,8 +37,10 @@ do
       return self:consume()
     end,
     consume = function(self)
-      self.__consume(self.batch)
+      --swap the batch out first. the consumer might yield, and adds meanwhile go in a fresh one
+      local batch = self.batch
       self:clear()
+      self.__consume(batch)
       return self
     end,
     clear = function(self)
@@ -102,7 +104,8 @@ local PageQueue; do
 
   -- load_page(queue_id, page_id); BlockWalker.pop_page(self.walk_id, self.page_id)
   -- store_page(queue_id, page_id, data)
-  -- store_item(item, page_state)
+  -- store_item(item, page_state, loaded_items)
+  -- load_items(items) (optional), returns a table of loaded_items for an idle page about to become active
   -- stored_page_size(queue_id, page_id)
   -- page_id
   
@@ -124,8 +127,11 @@ local PageQueue; do
         return self -- we're done here
       elseif new_state == "active" and (state == "idle" or state == "stored") then
         local store_item, data = self.store_item, self.data
+        local load_items = self.load_items
+        --bulk-load the whole page in one go, if the queue knows how
+        local loaded = load_items and load_items(data)
         for i, item in ipairs(data) do
-          item = store_item(item, "active")
+          item = store_item(item, "active", loaded)
           assert(item ~= nil, "store_item gave a nil result")
           rawset(data, i, item)
         end
@@ -251,6 +257,7 @@ local PageQueue; do
       id = page_id,
       
       store_item = data_handlers.store_item,
+      load_items = data_handlers.load_items,
       store_page = data_handlers.store_page,
       load_page = data_handlers.load_page,
       stored_page_size = data_handlers.stored_page_size,
@@ -385,6 +392,7 @@ local PageQueue; do
       id = assert(opt.id, "id missing"),
       data_handlers = {
         store_item = assert(opt.store_item, "store_item missing"),
+        load_items = opt.load_items,
         store_page = assert(opt.store_page, "store_page missing"),
         load_page =  assert(opt.load_page,  "load_page missing"),
         stored_page_size =  assert(opt.stored_page_size,  "stored_page_size missing"),
@@ -402,6 +410,261 @@ end
 
 util.PageQueue = PageQueue
 
+local WorkScheduler; do
+  -- per-worker job queues, each filled with about `horizon` seconds of work at that worker's
+  -- measured rate (work units per second, units being whatever cost(job) estimates).
+  -- a worker whose queue runs dry refills from the source, and once that's exhausted steals
+  -- the back half of the queue that has the most time left on it. when only `tail` jobs are
+  -- left and all of them are running, idle workers run duplicates of the oldest ones.
+  -- the first copy of a job to finish wins, the others should give up when finished(job) says so.
+  --
+  -- opt:
+  --   source:  anything with a :next() that returns a job, or nil when there are no more
+  --   key:     function(job), unique key for the job. defaults to the job itself
+  --   cost:    function(job), estimated work units. defaults to 1 per job
+  --   horizon: seconds of work to queue up per worker (10)
+  --   retry:   failed attempts allowed per job before it goes in .failures (2)
+  --   tail:    duplicate running jobs when this many or fewer are left (4)
+
+  local gettime = cutil.gettime
+
+  local WorkScheduler_meta = {__index = {
+    queue = function(self, worker)
+      local wq = self.workers[worker]
+      if not wq then
+        wq = {jobs = {}, cost = 0, rate = nil}
+        self.workers[worker] = wq
+      end
+      return wq
+    end,
+
+    push = function(self, wq, job)
+      local cost = self.cost(job)
+      table.insert(wq.jobs, {job = job, cost = cost})
+      wq.cost = wq.cost + cost
+    end,
+
+    pop = function(_, wq, from_back)
+      local item = table.remove(wq.jobs, (not from_back) and 1 or nil)
+      if item then
+        wq.cost = wq.cost - item.cost
+        return item.job
+      end
+    end,
+
+    fill = function(self, wq)
+      --with no measured rate yet, start with one job
+      local want = wq.rate and wq.rate * self.horizon or 0
+      repeat
+        local job = table.remove(self.pending)
+        if job == nil and not self.source_done then
+          job = self.source:next()
+          if job == nil then
+            self.source_done = true
+          end
+        end
+        if job == nil then break end
+        self:push(wq, job)
+      until wq.cost >= want
+      return #wq.jobs > 0
+    end,
+
+    steal = function(self, wq)
+      --the victim is whoever would take the longest to get through their queue
+      local victim, victim_time
+      for _, other in pairs(self.workers) do
+        if other ~= wq and #other.jobs > 0 then
+          local t = other.cost / (other.rate or self.min_rate)
+          if not victim or t > victim_time then
+            victim, victim_time = other, t
+          end
+        end
+      end
+      if not victim then
+        return false
+      end
+      for _ = 1, math.ceil(#victim.jobs / 2) do
+        local job = self:pop(victim, true)
+        self:push(wq, job)
+      end
+      self.stolen = self.stolen + 1
+      return true
+    end,
+
+    start = function(self, worker, job, duplicate)
+      local key = self.key(job)
+      local run = self.running[key]
+      if not run then
+        run = {job = job, workers = {}, copies = 0, started = gettime()}
+        self.running[key] = run
+        self.running_count = self.running_count + 1
+      end
+      run.workers[worker] = true
+      run.copies = run.copies + 1
+      if duplicate then
+        self.duplicated = self.duplicated + 1
+      end
+      return job, duplicate
+    end,
+
+    duplicate = function(self, worker)
+      if self.running_count > self.tail then
+        return nil
+      end
+      local oldest
+      for _, run in pairs(self.running) do
+        if not run.finished and not run.workers[worker] and run.copies < 2 then
+          if not oldest or run.started < oldest.started then
+            oldest = run
+          end
+        end
+      end
+      if oldest then
+        return self:start(worker, oldest.job, true)
+      end
+    end,
+
+    stop = function(self, worker, job)
+      local key = self.key(job)
+      local run = self.running[key]
+      if not run or not run.workers[worker] then
+        return nil
+      end
+      run.workers[worker] = nil
+      run.copies = run.copies - 1
+      if run.copies == 0 then
+        self.running[key] = nil
+        if not run.finished then
+          self.running_count = self.running_count - 1
+        end
+      end
+      return run
+    end,
+
+    --next job for the worker, and whether it's a duplicate of one already running elsewhere
+    next = function(self, worker)
+      local wq = self:queue(worker)
+      local job = self:pop(wq)
+      if job == nil and (self:fill(wq) or self:steal(wq)) then
+        job = self:pop(wq)
+      end
+      if job ~= nil then
+        return self:start(worker, job, false)
+      end
+      return self:duplicate(worker)
+    end,
+
+    --true if this was the first copy of the job to finish
+    done = function(self, worker, job, cost, elapsed)
+      local wq = self:queue(worker)
+      if cost and elapsed and elapsed > 0 then
+        local rate = math.max(cost / elapsed, self.min_rate)
+        wq.rate = wq.rate and (wq.rate * 0.7 + rate * 0.3) or rate
+      end
+      local run = self:stop(worker, job)
+      if not run or run.finished then
+        return false
+      end
+      run.finished = true
+      if run.copies > 0 then
+        self.running_count = self.running_count - 1
+      end
+      self.completed = self.completed + 1
+      return true
+    end,
+
+    failed = function(self, worker, job, err)
+      local run = self:stop(worker, job)
+      if not run or run.finished or run.copies > 0 then
+        return --someone else finished it, or is still working on it
+      end
+      local key = self.key(job)
+      local attempts = (self.attempts[key] or 0) + 1
+      self.attempts[key] = attempts
+      if attempts > self.retry then
+        self.attempts[key] = nil
+        table.insert(self.failures, job)
+        table.insert(self.failure_reasons, err or "?")
+      else
+        table.insert(self.pending, job)
+      end
+    end,
+
+    finished = function(self, job)
+      local run = self.running[self.key(job)]
+      return not run or run.finished
+    end,
+
+    --the worker's gone. its queue goes back in the pool, whatever it was running counts as failed
+    leave = function(self, worker, err)
+      local wq = self.workers[worker]
+      if not wq then return end
+      self.workers[worker] = nil
+      for _, item in ipairs(wq.jobs) do
+        table.insert(self.pending, item.job)
+      end
+      for _, run in pairs(self.running) do
+        if run.workers[worker] then
+          self:failed(worker, run.job, err or "worker left")
+        end
+      end
+    end,
+
+    --jobs that could still be handed out, not counting ones already running
+    has_work = function(self)
+      if #self.pending > 0 then
+        return true
+      end
+      for _, wq in pairs(self.workers) do
+        if #wq.jobs > 0 then
+          return true
+        end
+      end
+      if not self.source_done then
+        local job = self.source:next()
+        if job == nil then
+          self.source_done = true
+        else
+          table.insert(self.pending, job)
+          return true
+        end
+      end
+      return false
+    end,
+
+    active = function(self)
+      return self.running_count
+    end
+  }}
+
+  function WorkScheduler(opt)
+    return setmetatable({
+      source = assert(opt.source, "source missing"),
+      key = opt.key or function(job) return job end,
+      cost = opt.cost or function() return 1 end,
+      horizon = opt.horizon or 10,
+      retry = opt.retry or 2,
+      tail = opt.tail or 4,
+      min_rate = 0.1,
+
+      workers = {},
+      pending = {},
+      running = {},
+      running_count = 0,
+      attempts = {},
+      source_done = false,
+
+      completed = 0,
+      stolen = 0,
+      duplicated = 0,
+      failures = {},
+      failure_reasons = {}
+    }, WorkScheduler_meta)
+  end
+end
+
+util.WorkScheduler = WorkScheduler
+
 local MAX_BATCH_SIZE = 64
 local Ed25519Batch = {
   interval = 250, --ms